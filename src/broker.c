@@ -0,0 +1,374 @@
+/*
+ * udev-broker: probes input devices once on behalf of all processes.
+ *
+ * Holds the only devd connection on the host and relays devd's event stream
+ * to any number of clients over a seqpacket socket with the same wire
+ * format.  New event nodes are probed through the library before their
+ * CREATE is relayed, which records the result in the shared probe snapshot;
+ * clients then construct devices from the snapshot without opening the
+ * node.  See broker.h.
+ *
+ * A new node is probed again every second for a few seconds, so that
+ * attributes changed after the first probe (devfs rules applied late) are
+ * recorded before a client misses them.  Otherwise the broker only wakes
+ * up for devd and its clients.
+ *
+ * Clients that fall behind are disconnected, and all clients are when the
+ * devd connection is re-established.  A client's listener reconnects and
+ * reports what changed meanwhile as add and remove events.
+ */
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <poll.h>
+#include <unistd.h>
+
+#include "broker.h"
+#include "libudev.h"
+
+#define MAX_CLIENTS 64
+/* How long a new node is probed again, in seconds. */
+#define SETTLE_SECONDS 10
+
+struct broker {
+	struct udev *udev;
+	char const *devd_path;
+	int devd;
+	int listen_fd;
+	int clients[MAX_CLIENTS];
+	unsigned client_count;
+	/* Until when each node is probed again; 0 once it settled. */
+	time_t settle_until[100];
+	bool verbose;
+};
+
+static volatile sig_atomic_t quit;
+
+static void
+on_signal(int sig)
+{
+	(void)sig;
+	quit = 1;
+}
+
+/* Listening sockets are created with the given permissions. */
+static int
+socket_at(char const *path, bool do_listen, mode_t mode)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = PF_LOCAL;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+	int fd = socket(PF_LOCAL, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	int ret;
+	if (do_listen) {
+		unlink(path);
+		mode_t old_mask = umask(~mode & 0777);
+		ret = bind(fd, (struct sockaddr *)&addr,
+			  (socklen_t)SUN_LEN(&addr)) < 0;
+		umask(old_mask);
+		ret = ret || listen(fd, 16) < 0;
+	} else {
+		ret = connect(fd, (struct sockaddr *)&addr,
+			  (socklen_t)SUN_LEN(&addr)) < 0;
+	}
+	if (ret) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Probes a node unless the snapshot already has a current record for it.
+ * Devices probe lazily, asking for any probed data triggers it. */
+static void
+probe_node(struct broker *b, unsigned node)
+{
+	char path[32];
+	snprintf(path, sizeof(path), "/dev/input/event%u", node);
+
+	struct udev_device *dev = udev_device_new_from_syspath(b->udev, path);
+	if (dev) {
+		udev_device_get_is_initialized(dev);
+		udev_device_unref(dev);
+	}
+}
+
+static void
+rescan(struct broker *b)
+{
+	char path[32];
+	struct stat st;
+
+	for (unsigned i = 0; i < 100; ++i) {
+		snprintf(path, sizeof(path), "/dev/input/event%u", i);
+		if (stat(path, &st) == 0) {
+			probe_node(b, i);
+		}
+	}
+}
+
+static void
+settle(struct broker *b, time_t now)
+{
+	for (unsigned i = 0; i < 100; ++i) {
+		if (b->settle_until[i] == 0) {
+			continue;
+		}
+		if (now >= b->settle_until[i]) {
+			b->settle_until[i] = 0;
+		}
+		probe_node(b, i);
+	}
+}
+
+static bool
+settling(struct broker const *b)
+{
+	for (unsigned i = 0; i < 100; ++i) {
+		if (b->settle_until[i] != 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void
+drop_client(struct broker *b, unsigned i)
+{
+	if (b->verbose) {
+		fprintf(
+		    stderr, "udev-broker: client %d gone\n", b->clients[i]);
+	}
+	close(b->clients[i]);
+	b->clients[i] = b->clients[--b->client_count];
+}
+
+/* Clients that do not keep up are disconnected.  Their listener notices,
+ * reconnects and catches up by rescanning. */
+static void
+relay(struct broker *b, char const *event, size_t len)
+{
+	for (unsigned i = 0; i < b->client_count;) {
+		if (send(b->clients[i], event, len,
+			MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)len) {
+			drop_client(b, i);
+			continue;
+		}
+		++i;
+	}
+}
+
+static void
+on_devd_event(struct broker *b)
+{
+	char event[1024];
+	ssize_t len = recv(b->devd, event, sizeof(event) - 1, 0);
+
+	if (len <= 0) {
+		fprintf(stderr, "udev-broker: lost devd connection\n");
+		close(b->devd);
+		b->devd = -1;
+		return;
+	}
+	event[len] = '\0';
+
+	unsigned node;
+	char const *cdev = strstr(event, "cdev=input/event");
+	if (cdev && strstr(event, "type=CREATE") &&
+	    sscanf(cdev, "cdev=input/event%u", &node) == 1 && node < 100) {
+		probe_node(b, node);
+		b->settle_until[node] = time(NULL) + SETTLE_SECONDS;
+	}
+
+	relay(b, event, (size_t)len);
+}
+
+/* Events were lost while devd was unreachable.  Record the nodes that
+ * appeared meanwhile and make every client catch up. */
+static void
+on_devd_connect(struct broker *b)
+{
+	rescan(b);
+	while (b->client_count > 0) {
+		drop_client(b, b->client_count - 1);
+	}
+}
+
+static void
+on_client(struct broker *b)
+{
+	int fd = accept4(b->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+
+	if (b->client_count == MAX_CLIENTS) {
+		fprintf(stderr, "udev-broker: too many clients\n");
+		close(fd);
+		return;
+	}
+
+	if (b->verbose) {
+		fprintf(stderr, "udev-broker: client %d connected\n", fd);
+	}
+	b->clients[b->client_count++] = fd;
+}
+
+static void
+usage(char const *argv0)
+{
+	fprintf(stderr,
+	    "usage: %s [-s socket] [-d devd-socket] [-m mode] [-v]\n"
+	    "  -s  socket to serve (default " BROKER_SOCKET_PATH ")\n"
+	    "  -d  devd socket to relay (default " DEVD_SOCKET_PATH ")\n"
+	    "  -m  permissions of the served socket, in octal (default\n"
+	    "      those of the devd socket)\n"
+	    "  -v  log client connections\n",
+	    argv0);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct broker b = {
+	    .devd_path = DEVD_SOCKET_PATH,
+	    .devd = -1,
+	    .listen_fd = -1,
+	};
+	char const *socket_path = BROKER_SOCKET_PATH;
+	long mode = -1;
+	char *end;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:d:m:vh")) != -1) {
+		switch (opt) {
+		case 's':
+			socket_path = optarg;
+			break;
+		case 'd':
+			b.devd_path = optarg;
+			break;
+		case 'm':
+			mode = strtol(optarg, &end, 8);
+			if (*optarg == '\0' || *end != '\0' || mode < 0 ||
+			    mode > 0777) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'v':
+			b.verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	b.udev = udev_new();
+	if (!b.udev) {
+		fprintf(stderr, "udev-broker: could not create context\n");
+		return 1;
+	}
+
+	/* Serve whoever may read devd itself, nobody else.  If devd's
+	 * socket cannot be found, only the owner. */
+	struct stat st;
+	if (mode < 0) {
+		mode = stat(b.devd_path, &st) == 0 ? st.st_mode & 0777 : 0600;
+	}
+
+	b.listen_fd = socket_at(socket_path, true, (mode_t)mode);
+	if (b.listen_fd < 0) {
+		perror(socket_path);
+		return 1;
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	time_t last_settle = time(NULL);
+
+	while (!quit) {
+		struct pollfd pfd[2 + MAX_CLIENTS];
+		unsigned n = 0;
+
+		/* Connect before scanning, so no node falls in between. */
+		if (b.devd < 0) {
+			b.devd = socket_at(b.devd_path, false, 0);
+			if (b.devd >= 0) {
+				on_devd_connect(&b);
+			}
+		}
+		pfd[n++] = (struct pollfd){b.devd, POLLIN, 0};
+		pfd[n++] = (struct pollfd){b.listen_fd, POLLIN, 0};
+		for (unsigned i = 0; i < b.client_count; ++i) {
+			pfd[n++] = (struct pollfd){b.clients[i], POLLIN, 0};
+		}
+
+		/* Sleep until something happens, unless a node is settling
+		 * or devd is to be reconnected. */
+		int timeout = b.devd < 0 || settling(&b) ? 1000 : -1;
+		int ret = poll(pfd, n, timeout);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("poll");
+			break;
+		}
+
+		/* Clients never send anything; readable means hangup.  Going
+		 * backwards keeps the pollfd indices valid while dropping. */
+		for (unsigned i = b.client_count; i-- > 0;) {
+			if (pfd[2 + i].revents) {
+				drop_client(&b, i);
+			}
+		}
+		if (pfd[0].revents) {
+			on_devd_event(&b);
+		}
+		if (pfd[1].revents) {
+			on_client(&b);
+		}
+
+		time_t now = time(NULL);
+		if (now != last_settle) {
+			settle(&b, now);
+			last_settle = now;
+		}
+	}
+
+	for (unsigned i = 0; i < b.client_count; ++i) {
+		close(b.clients[i]);
+	}
+	if (b.devd >= 0) {
+		close(b.devd);
+	}
+	close(b.listen_fd);
+	unlink(socket_path);
+	udev_unref(b.udev);
+
+	return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef LIBUDEV_FBSD_BROKER_H_
+#define LIBUDEV_FBSD_BROKER_H_
+
+/*
+ * Sockets the library takes its event stream from.
+ *
+ * udev-broker connects to devd once for all processes on the host and
+ * serves a seqpacket socket with the same wire format.  Before relaying the
+ * creation of an event node it probes the node and records the result in
+ * the probe snapshot, so clients find every announced device there and
+ * never open a node themselves.  Clients try the broker first and fall
+ * back to devd and in-process probing when it is not running.
+ *
+ * Setting the devd socket through the environment bypasses the broker,
+ * which lets devd-loadgen stand in for devd on hosts that do not run it.
+ */
+
+#define DEVD_SOCKET_PATH "/var/run/devd.seqpacket.pipe"
+#define DEVD_SOCKET_ENV "LIBUDEV_DEVD_SOCKET"
+
+#define BROKER_SOCKET_PATH "/var/run/libudev-fbsd.broker"
+#define BROKER_SOCKET_ENV "LIBUDEV_BROKER_SOCKET"
+
+#endif
@@ -0,0 +1,471 @@
+/*
+ * devd-loadgen: a devd stand-in for measuring udev_monitor latency.
+ *
+ * Serves a seqpacket socket that speaks devd's wire format and replays
+ * either a script or a randomized stream of input CREATE/DESTROY events,
+ * interleaved with unrelated noise.  The same process consumes the stream
+ * through libudev (with LIBUDEV_DEVD_SOCKET pointed at the stand-in) and
+ * reports latency percentiles from devd send to the return of
+ * udev_monitor_receive_device().
+ *
+ * CREATE events are only generated for nodes that exist and are readable,
+ * so the measured path includes the real probe of those devices.  Random
+ * mode refuses to run without any such node, as it would measure nothing.
+ * Events are matched by action and node.  Events the library withholds
+ * are counted as not delivered instead of skewing the latencies: adds of
+ * nodes that cannot be probed yet, and removes of such nodes while their
+ * add is still withheld.  Every other remove is delivered, also for nodes
+ * whose add was never received.
+ */
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "libudev.h"
+
+#define MAX_NODES 100
+
+struct sent_event {
+	uint64_t ns;
+	bool create;
+	unsigned node;
+};
+
+struct loadgen {
+	char const *socket_path;
+	char const *script_path;
+	unsigned count;
+	unsigned rate;
+	unsigned noise;
+	unsigned nodes;
+	unsigned seed;
+
+	int listen_fd;
+
+	/* Nodes random CREATE events are picked from. */
+	unsigned readable[MAX_NODES];
+	unsigned n_readable;
+
+	/* Input events sent to the monitor, in order. */
+	struct sent_event *sent_events;
+	unsigned sent;
+	unsigned expected;
+	pthread_mutex_t lock;
+	bool done;
+};
+
+static char const *const noise_events[] = {
+    "!system=USB subsystem=INTERFACE type=ATTACH ugen=ugen0.2 vendor=0x046d "
+    "product=0xc52b devclass=0x00 intclass=0x03\n",
+    "!system=DEVFS subsystem=CDEV type=CREATE cdev=ttyU0\n",
+    "!system=DEVFS subsystem=CDEV type=DESTROY cdev=ttyU0\n",
+    "!system=IFNET subsystem=em0 type=LINK_UP\n",
+    "+uhid0 at bus=0 sernum=\"\" on uhub0\n",
+    "!system=DEVFS subsystem=CDEV type=CREATE cdev=input/mouse0\n",
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void
+sleep_ns(uint64_t ns)
+{
+	struct timespec ts = {(time_t)(ns / 1000000000u),
+	    (long)(ns % 1000000000u)};
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+	}
+}
+
+static bool
+is_input_event(char const *event)
+{
+	return strstr(event, "cdev=input/event") != NULL &&
+	    (strstr(event, "type=CREATE") != NULL ||
+		strstr(event, "type=DESTROY") != NULL);
+}
+
+static int
+send_event(struct loadgen *lg, int fd, char const *event)
+{
+	bool counted = is_input_event(event);
+	uint64_t t = now_ns();
+
+	if (counted) {
+		struct sent_event sent = {
+		    t, strstr(event, "type=CREATE") != NULL, 0};
+		sscanf(strstr(event, "cdev=input/event"), "cdev=input/event%u",
+		    &sent.node);
+		pthread_mutex_lock(&lg->lock);
+		if (lg->sent < lg->expected) {
+			lg->sent_events[lg->sent++] = sent;
+		}
+		pthread_mutex_unlock(&lg->lock);
+	}
+
+	if (send(fd, event, strlen(event), MSG_NOSIGNAL) < 0) {
+		perror("send");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+run_script(struct loadgen *lg, int fd, uint64_t interval)
+{
+	FILE *f = fopen(lg->script_path, "r");
+	if (!f) {
+		perror(lg->script_path);
+		return -1;
+	}
+
+	char line[1024];
+	int ret = 0;
+	while (fgets(line, sizeof(line), f)) {
+		unsigned ms;
+		if (line[0] == '#' || line[0] == '\n') {
+			continue;
+		}
+		if (sscanf(line, "sleep %u", &ms) == 1) {
+			sleep_ns((uint64_t)ms * 1000000u);
+			continue;
+		}
+		if ((ret = send_event(lg, fd, line)) < 0) {
+			break;
+		}
+		sleep_ns(interval);
+	}
+
+	fclose(f);
+	return ret;
+}
+
+static void
+find_readable(struct loadgen *lg)
+{
+	char path[32];
+
+	for (unsigned i = 0; i < lg->nodes; ++i) {
+		snprintf(path, sizeof(path), "/dev/input/event%u", i);
+		if (access(path, R_OK) == 0) {
+			lg->readable[lg->n_readable++] = i;
+		}
+	}
+}
+
+static int
+run_random(struct loadgen *lg, int fd, uint64_t interval)
+{
+	srand(lg->seed);
+
+	char event[256];
+	for (unsigned i = 0; i < lg->count; ++i) {
+		for (unsigned k = 0; k < lg->noise; ++k) {
+			unsigned n = (unsigned)rand() %
+			    (sizeof(noise_events) / sizeof(noise_events[0]));
+			if (send_event(lg, fd, noise_events[n]) < 0) {
+				return -1;
+			}
+		}
+
+		bool create = rand() & 1;
+		unsigned node = create
+		    ? lg->readable[(unsigned)rand() % lg->n_readable]
+		    : (unsigned)rand() % lg->nodes;
+		snprintf(event, sizeof(event),
+		    "!system=DEVFS subsystem=CDEV type=%s "
+		    "cdev=input/event%u\n",
+		    create ? "CREATE" : "DESTROY", node);
+		if (send_event(lg, fd, event) < 0) {
+			return -1;
+		}
+		sleep_ns(interval);
+	}
+
+	return 0;
+}
+
+static void *
+devd_server(void *arg)
+{
+	struct loadgen *lg = arg;
+
+	int fd = accept(lg->listen_fd, NULL, NULL);
+	if (fd < 0) {
+		perror("accept");
+	} else {
+		uint64_t interval = lg->rate ? 1000000000u / lg->rate : 0;
+		if (lg->script_path) {
+			run_script(lg, fd, interval);
+		} else {
+			run_random(lg, fd, interval);
+		}
+	}
+
+	pthread_mutex_lock(&lg->lock);
+	lg->done = true;
+	pthread_mutex_unlock(&lg->lock);
+
+	/* Keep the connection open until the consumer is finished, so the
+	 * monitor does not observe EOF while draining. */
+	return (void *)(intptr_t)fd;
+}
+
+static unsigned
+count_script_events(char const *script_path)
+{
+	FILE *f = fopen(script_path, "r");
+	if (!f) {
+		return 0;
+	}
+
+	char line[1024];
+	unsigned n = 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] != '#' && is_input_event(line)) {
+			++n;
+		}
+	}
+
+	fclose(f);
+	return n;
+}
+
+static int
+compare_u64(void const *a, void const *b)
+{
+	uint64_t x = *(uint64_t const *)a;
+	uint64_t y = *(uint64_t const *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void
+report(uint64_t *lat, unsigned n, unsigned missed, unsigned lost,
+    unsigned expected)
+{
+	printf("events: %u expected, %u received, %u not delivered "
+	       "(%u lost to a full queue)\n",
+	    expected, n, missed, lost);
+	if (n == 0) {
+		return;
+	}
+
+	qsort(lat, n, sizeof(*lat), compare_u64);
+
+	double const pct[] = {50.0, 90.0, 99.0, 99.9};
+	for (unsigned i = 0; i < sizeof(pct) / sizeof(pct[0]); ++i) {
+		unsigned idx = (unsigned)(pct[i] / 100.0 * (n - 1) + 0.5);
+		printf("p%-5g %10.1f us\n", pct[i], lat[idx] / 1000.0);
+	}
+	printf("max    %10.1f us\n", lat[n - 1] / 1000.0);
+}
+
+static void
+usage(char const *argv0)
+{
+	fprintf(stderr,
+	    "usage: %s [-s socket] [-f script] [-n count] [-r rate] "
+	    "[-x noise] [-N nodes] [-S seed]\n"
+	    "  -s  socket path served instead of devd's\n"
+	    "  -f  replay devd lines from a file ('sleep <ms>' pauses)\n"
+	    "  -n  number of random input events (default 1000)\n"
+	    "  -r  events per second, 0 for as fast as possible "
+	    "(default 1000)\n"
+	    "  -x  noise events sent before each input event (default 2)\n"
+	    "  -N  event nodes to pick from (default 32)\n"
+	    "  -S  random seed (default 1)\n",
+	    argv0);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct loadgen lg = {
+	    .socket_path = "/tmp/devd-loadgen.pipe",
+	    .count = 1000,
+	    .rate = 1000,
+	    .noise = 2,
+	    .nodes = 32,
+	    .seed = 1,
+	    .listen_fd = -1,
+	};
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:f:n:r:x:N:S:h")) != -1) {
+		switch (opt) {
+		case 's':
+			lg.socket_path = optarg;
+			break;
+		case 'f':
+			lg.script_path = optarg;
+			break;
+		case 'n':
+			lg.count = (unsigned)strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			lg.rate = (unsigned)strtoul(optarg, NULL, 0);
+			break;
+		case 'x':
+			lg.noise = (unsigned)strtoul(optarg, NULL, 0);
+			break;
+		case 'N':
+			lg.nodes = (unsigned)strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			lg.seed = (unsigned)strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (lg.nodes == 0 || lg.nodes > MAX_NODES) {
+		fprintf(stderr, "nodes must be between 1 and %d\n", MAX_NODES);
+		return 1;
+	}
+
+	if (!lg.script_path) {
+		find_readable(&lg);
+		if (lg.n_readable == 0) {
+			fprintf(stderr,
+			    "no readable node among /dev/input/event0 to "
+			    "event%u; random mode needs devices to probe, "
+			    "use -f to replay a script instead\n",
+			    lg.nodes - 1);
+			return 1;
+		}
+	}
+
+	lg.expected = lg.script_path ? count_script_events(lg.script_path)
+				     : lg.count;
+	lg.sent_events = calloc(lg.expected + 1, sizeof(struct sent_event));
+	uint64_t *lat = calloc(lg.expected + 1, sizeof(uint64_t));
+	if (!lg.sent_events || !lat) {
+		perror("calloc");
+		return 1;
+	}
+	pthread_mutex_init(&lg.lock, NULL);
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = PF_LOCAL;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", lg.socket_path);
+	unlink(lg.socket_path);
+
+	lg.listen_fd = socket(PF_LOCAL, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (lg.listen_fd < 0 ||
+	    bind(lg.listen_fd, (struct sockaddr *)&addr,
+		(socklen_t)SUN_LEN(&addr)) < 0 ||
+	    listen(lg.listen_fd, 1) < 0) {
+		perror(lg.socket_path);
+		return 1;
+	}
+
+	pthread_t server;
+	if (pthread_create(&server, NULL, devd_server, &lg) != 0) {
+		fprintf(stderr, "could not start devd stand-in\n");
+		return 1;
+	}
+
+	setenv("LIBUDEV_DEVD_SOCKET", lg.socket_path, 1);
+
+	struct udev *udev = udev_new();
+	struct udev_monitor *mon = udev_monitor_new_from_netlink(udev, "udev");
+	if (!udev || !mon) {
+		fprintf(stderr, "could not create monitor\n");
+		return 1;
+	}
+	udev_monitor_filter_add_match_subsystem_devtype(mon, "input", NULL);
+	udev_monitor_enable_receiving(mon);
+
+	struct pollfd pfd = {udev_monitor_get_fd(mon), POLLIN, 0};
+	unsigned received = 0;
+	unsigned missed = 0;
+	unsigned lost = 0;
+	unsigned long long last_seqnum = 0;
+	unsigned next = 0;
+
+	while (next < lg.expected) {
+		int ret = poll(&pfd, 1, 2000);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret <= 0) {
+			pthread_mutex_lock(&lg.lock);
+			bool done = lg.done;
+			pthread_mutex_unlock(&lg.lock);
+			if (done) {
+				missed += lg.expected - next;
+				break;
+			}
+			continue;
+		}
+
+		struct udev_device *dev = udev_monitor_receive_device(mon);
+		uint64_t t = now_ns();
+		if (!dev) {
+			continue;
+		}
+
+		unsigned long long seqnum = udev_device_get_seqnum(dev);
+		lost += (unsigned)(seqnum - last_seqnum - 1);
+		last_seqnum = seqnum;
+
+		bool create = strcmp(udev_device_get_action(dev), "add") == 0;
+		unsigned node = 0;
+		sscanf(udev_device_get_devnode(dev), "/dev/input/event%u",
+		    &node);
+		udev_device_unref(dev);
+
+		pthread_mutex_lock(&lg.lock);
+		while (next < lg.sent &&
+		    (lg.sent_events[next].create != create ||
+			lg.sent_events[next].node != node)) {
+			++next;
+			++missed;
+		}
+		if (next < lg.sent) {
+			lat[received++] = t - lg.sent_events[next++].ns;
+		}
+		pthread_mutex_unlock(&lg.lock);
+	}
+
+	void *server_ret;
+	pthread_join(server, &server_ret);
+
+	report(lat, received, missed, lost, lg.expected);
+
+	udev_monitor_unref(mon);
+	udev_unref(udev);
+
+	int fd = (int)(intptr_t)server_ret;
+	if (fd >= 0) {
+		close(fd);
+	}
+	close(lg.listen_fd);
+	unlink(lg.socket_path);
+	free(lat);
+	free(lg.sent_events);
+
+	return 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * Compiles libudev.hpp as C++17 and checks the ownership rules it promises.
+ * Nothing here runs; the object is built so that the header cannot rot.
+ */
+#include "libudev.hpp"
+
+#include <type_traits>
+
+namespace {
+
+using namespace libudev;
+
+static_assert(!std::is_copy_constructible_v<device>);
+static_assert(std::is_nothrow_move_constructible_v<device>);
+static_assert(std::is_nothrow_move_assignable_v<device>);
+static_assert(!std::is_convertible_v<device &, device_view>,
+    "a device must not slice into a view of its own reference");
+static_assert(!std::is_convertible_v<device &&, device_view>);
+static_assert(std::is_trivially_copyable_v<device_view>);
+static_assert(!std::is_convertible_v<list_entry, bool>);
+static_assert(std::is_constructible_v<bool, list_entry>);
+
+static_assert(!std::is_copy_constructible_v<context>);
+static_assert(!std::is_copy_constructible_v<monitor>);
+static_assert(!std::is_copy_constructible_v<enumerate>);
+static_assert(std::is_nothrow_move_constructible_v<enumerate>);
+
+static_assert(std::is_same_v<std::iterator_traits<
+				 list_range::iterator>::iterator_category,
+    std::forward_iterator_tag>);
+
+[[maybe_unused]] std::size_t
+use(context const &ctx)
+{
+	enumerate e = enumerate::create(ctx);
+	e.add_match_subsystem("input");
+	e.scan();
+
+	std::size_t n = 0;
+	for (list_entry entry : e) {
+		device dev = ctx.device_from_syspath(entry.name().data());
+		if (!dev || !dev.has(input_class::keyboard)) {
+			continue;
+		}
+		device copy = device::ref(dev.view());
+		n += copy.syspath().size();
+		if (device parent = device::ref(dev.parent())) {
+			n += parent.sysname().size();
+		}
+		for (list_entry prop : dev.properties()) {
+			n += prop.value().size();
+		}
+	}
+	if (list_entry entry = e.find("event0")) {
+		n += entry.name().size();
+	}
+	return n;
+}
+
+} // namespace
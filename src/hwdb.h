@@ -0,0 +1,60 @@
+#ifndef LIBUDEV_FBSD_HWDB_H_
+#define LIBUDEV_FBSD_HWDB_H_
+
+/*
+ * On-disk format of the compiled hwdb, shared by udev-hwdb and the library.
+ *
+ * The file is a character trie over the literal prefixes of the match
+ * patterns.  A pattern is split at its first glob character: the literal
+ * part selects a trie node, the remainder is stored as a glob on that node
+ * and checked with fnmatch(3) against the rest of the lookup key.  A lookup
+ * therefore walks the key once and only runs fnmatch for globs hanging off
+ * the nodes on its path.
+ *
+ * Offsets named *_off are byte offsets from the start of the file; string
+ * offsets are relative to strings_off.  Children of a node are sorted by
+ * character.  When several entries match, entries with a longer literal
+ * prefix override shorter ones and exact matches override globs.
+ */
+
+#include <stdint.h>
+
+#define HWDB_MAGIC "LUDVHWDB"
+#define HWDB_VERSION 1
+
+struct hwdb_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t file_size;
+	uint32_t nodes_off;
+	uint32_t node_count;
+	uint32_t strings_off;
+	uint32_t strings_size;
+};
+
+struct hwdb_node {
+	uint32_t children_off; /* struct hwdb_child[child_count] */
+	uint32_t child_count;
+	uint32_t globs_off; /* struct hwdb_glob[glob_count] */
+	uint32_t glob_count;
+	uint32_t props_off; /* struct hwdb_prop[prop_count], exact matches */
+	uint32_t prop_count;
+};
+
+struct hwdb_child {
+	uint32_t c;
+	uint32_t node; /* index into the node array */
+};
+
+struct hwdb_glob {
+	uint32_t pattern; /* string offset of the glob suffix */
+	uint32_t props_off;
+	uint32_t prop_count;
+};
+
+struct hwdb_prop {
+	uint32_t key;   /* string offset */
+	uint32_t value; /* string offset */
+};
+
+#endif
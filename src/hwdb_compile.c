@@ -0,0 +1,413 @@
+/*
+ * udev-hwdb: compiles hwdb text files into the trie read by the library.
+ *
+ * The input format is the one of systemd's hwdb: one or more match lines
+ * starting in the first column, followed by property lines of the form
+ * " KEY=VALUE", terminated by an empty line.  Lines starting with '#' are
+ * comments.  See hwdb.h for the output format.
+ */
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hwdb.h"
+
+struct prop {
+	char *key;
+	char *value;
+};
+
+/* A group of properties shared by all match lines above it. */
+struct record {
+	struct prop *props;
+	size_t prop_count;
+};
+
+struct glob {
+	char *pattern;
+	size_t record;
+};
+
+struct child {
+	unsigned char c;
+	size_t node;
+};
+
+struct node {
+	struct child *children;
+	size_t child_count;
+	struct glob *globs;
+	size_t glob_count;
+	size_t *exact; /* records matching exactly here */
+	size_t exact_count;
+};
+
+struct trie {
+	struct node *nodes;
+	size_t node_count;
+	struct record *records;
+	size_t record_count;
+};
+
+static void *
+xrealloc(void *ptr, size_t nmemb, size_t size)
+{
+	void *p = reallocarray(ptr, nmemb, size);
+	if (!p) {
+		perror("realloc");
+		exit(1);
+	}
+	return p;
+}
+
+static char *
+xstrdup(char const *s)
+{
+	char *p = strdup(s);
+	if (!p) {
+		perror("strdup");
+		exit(1);
+	}
+	return p;
+}
+
+static size_t
+trie_new_node(struct trie *trie)
+{
+	trie->nodes = xrealloc(
+	    trie->nodes, trie->node_count + 1, sizeof(struct node));
+	memset(&trie->nodes[trie->node_count], 0, sizeof(struct node));
+	return trie->node_count++;
+}
+
+static size_t
+trie_child(struct trie *trie, size_t node, unsigned char c)
+{
+	struct node *n = &trie->nodes[node];
+	size_t i;
+
+	for (i = 0; i < n->child_count && n->children[i].c < c; ++i) {
+	}
+	if (i < n->child_count && n->children[i].c == c) {
+		return n->children[i].node;
+	}
+
+	size_t child = trie_new_node(trie);
+	n = &trie->nodes[node];
+	n->children =
+	    xrealloc(n->children, n->child_count + 1, sizeof(struct child));
+	memmove(&n->children[i + 1], &n->children[i],
+	    (n->child_count - i) * sizeof(struct child));
+	n->children[i] = (struct child){c, child};
+	++n->child_count;
+	return child;
+}
+
+static void
+trie_insert(struct trie *trie, char const *match, size_t record)
+{
+	size_t node = 0;
+	size_t literal = strcspn(match, "*?[");
+
+	for (size_t i = 0; i < literal; ++i) {
+		node = trie_child(trie, node, (unsigned char)match[i]);
+	}
+
+	struct node *n = &trie->nodes[node];
+	if (match[literal] == '\0') {
+		n->exact =
+		    xrealloc(n->exact, n->exact_count + 1, sizeof(size_t));
+		n->exact[n->exact_count++] = record;
+	} else {
+		n->globs =
+		    xrealloc(n->globs, n->glob_count + 1, sizeof(struct glob));
+		n->globs[n->glob_count++] =
+		    (struct glob){xstrdup(match + literal), record};
+	}
+}
+
+static size_t
+trie_new_record(struct trie *trie)
+{
+	trie->records = xrealloc(
+	    trie->records, trie->record_count + 1, sizeof(struct record));
+	memset(&trie->records[trie->record_count], 0, sizeof(struct record));
+	return trie->record_count++;
+}
+
+static void
+record_add_prop(struct record *rec, char const *line)
+{
+	char const *eq = strchr(line, '=');
+	if (!eq || eq == line) {
+		return;
+	}
+
+	rec->props =
+	    xrealloc(rec->props, rec->prop_count + 1, sizeof(struct prop));
+	rec->props[rec->prop_count++] = (struct prop){
+	    strndup(line, (size_t)(eq - line)), xstrdup(eq + 1)};
+}
+
+static int
+parse_file(struct trie *trie, char const *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	char **matches = NULL;
+	size_t match_count = 0;
+	size_t record = 0;
+	bool in_props = false;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+	unsigned lineno = 0;
+
+	while ((len = getline(&line, &line_size, f)) >= 0) {
+		++lineno;
+		while (len > 0 &&
+		    (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+			line[--len] = '\0';
+		}
+
+		if (line[0] == '#') {
+			continue;
+		}
+
+		if (len == 0) {
+			for (size_t i = 0; i < match_count; ++i) {
+				free(matches[i]);
+			}
+			match_count = 0;
+			in_props = false;
+			continue;
+		}
+
+		if (line[0] != ' ' && line[0] != '\t') {
+			if (in_props) {
+				fprintf(stderr,
+				    "%s:%u: match after properties, "
+				    "missing empty line\n",
+				    path, lineno);
+				continue;
+			}
+			matches = xrealloc(
+			    matches, match_count + 1, sizeof(char *));
+			matches[match_count++] = xstrdup(line);
+			continue;
+		}
+
+		if (match_count == 0) {
+			fprintf(stderr, "%s:%u: property without match\n",
+			    path, lineno);
+			continue;
+		}
+
+		if (!in_props) {
+			record = trie_new_record(trie);
+			for (size_t i = 0; i < match_count; ++i) {
+				trie_insert(trie, matches[i], record);
+			}
+			in_props = true;
+		}
+
+		char const *prop = line + strspn(line, " \t");
+		record_add_prop(&trie->records[record], prop);
+	}
+
+	for (size_t i = 0; i < match_count; ++i) {
+		free(matches[i]);
+	}
+	free(matches);
+	free(line);
+	fclose(f);
+	return 0;
+}
+
+struct output {
+	char *buf;
+	size_t size;
+	char *strings;
+	size_t strings_size;
+};
+
+static uint32_t
+out_append(struct output *out, void const *data, size_t size)
+{
+	uint32_t off = (uint32_t)out->size;
+	out->buf = xrealloc(out->buf, out->size + size, 1);
+	memcpy(out->buf + out->size, data, size);
+	out->size += size;
+	return off;
+}
+
+static uint32_t
+out_string(struct output *out, char const *s)
+{
+	size_t len = strlen(s) + 1;
+	uint32_t off = (uint32_t)out->strings_size;
+	out->strings = xrealloc(out->strings, out->strings_size + len, 1);
+	memcpy(out->strings + out->strings_size, s, len);
+	out->strings_size += len;
+	return off;
+}
+
+static uint32_t
+out_props(struct output *out, struct record const *rec)
+{
+	uint32_t off = (uint32_t)out->size;
+	for (size_t i = 0; i < rec->prop_count; ++i) {
+		struct hwdb_prop p = {out_string(out, rec->props[i].key),
+		    out_string(out, rec->props[i].value)};
+		out_append(out, &p, sizeof(p));
+	}
+	return off;
+}
+
+static int
+write_trie(struct trie const *trie, char const *path)
+{
+	struct output out = {0};
+	struct hwdb_header hdr = {HWDB_MAGIC, HWDB_VERSION, 0, 0, 0, 0, 0};
+	out_append(&out, &hdr, sizeof(hdr));
+
+	uint32_t nodes_off = (uint32_t)out.size;
+	struct hwdb_node *nodes = calloc(trie->node_count, sizeof(*nodes));
+	if (!nodes) {
+		perror("calloc");
+		return -1;
+	}
+	out_append(&out, nodes, trie->node_count * sizeof(*nodes));
+
+	for (size_t i = 0; i < trie->node_count; ++i) {
+		struct node const *n = &trie->nodes[i];
+
+		nodes[i].children_off = (uint32_t)out.size;
+		nodes[i].child_count = (uint32_t)n->child_count;
+		for (size_t k = 0; k < n->child_count; ++k) {
+			struct hwdb_child c = {
+			    n->children[k].c, (uint32_t)n->children[k].node};
+			out_append(&out, &c, sizeof(c));
+		}
+
+		nodes[i].props_off = (uint32_t)out.size;
+		for (size_t k = 0; k < n->exact_count; ++k) {
+			struct record const *rec = &trie->records[n->exact[k]];
+			out_props(&out, rec);
+			nodes[i].prop_count += (uint32_t)rec->prop_count;
+		}
+
+		struct hwdb_glob *globs = calloc(n->glob_count + 1,
+		    sizeof(*globs));
+		if (!globs) {
+			perror("calloc");
+			return -1;
+		}
+		for (size_t k = 0; k < n->glob_count; ++k) {
+			struct record const *rec =
+			    &trie->records[n->globs[k].record];
+			globs[k].pattern =
+			    out_string(&out, n->globs[k].pattern);
+			globs[k].props_off = out_props(&out, rec);
+			globs[k].prop_count = (uint32_t)rec->prop_count;
+		}
+		nodes[i].globs_off = out_append(
+		    &out, globs, n->glob_count * sizeof(*globs));
+		nodes[i].glob_count = (uint32_t)n->glob_count;
+		free(globs);
+	}
+
+	memcpy(out.buf + nodes_off, nodes, trie->node_count * sizeof(*nodes));
+	free(nodes);
+
+	uint32_t strings_off = out_append(&out, out.strings, out.strings_size);
+
+	struct hwdb_header *h = (struct hwdb_header *)out.buf;
+	h->file_size = (uint32_t)out.size;
+	h->nodes_off = nodes_off;
+	h->node_count = (uint32_t)trie->node_count;
+	h->strings_off = strings_off;
+	h->strings_size = (uint32_t)out.strings_size;
+
+	/* Replace atomically, processes may have the old file mapped. */
+	char *tmp_path;
+	if (asprintf(&tmp_path, "%s.XXXXXX", path) < 0) {
+		perror("asprintf");
+		return -1;
+	}
+	int fd = mkstemp(tmp_path);
+	int ret = 0;
+	if (fd < 0 || fchmod(fd, 0644) != 0 ||
+	    write(fd, out.buf, out.size) != (ssize_t)out.size ||
+	    fsync(fd) != 0 || rename(tmp_path, path) != 0) {
+		perror(path);
+		unlink(tmp_path);
+		ret = -1;
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	free(tmp_path);
+	free(out.buf);
+	free(out.strings);
+	return ret;
+}
+
+static void
+usage(char const *argv0)
+{
+	fprintf(stderr, "usage: %s [-o output] file...\n", argv0);
+}
+
+int
+main(int argc, char **argv)
+{
+	char const *output = HWDB_PATH;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "o:h")) != -1) {
+		switch (opt) {
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind == argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	struct trie trie = {0};
+	trie_new_node(&trie);
+
+	for (int i = optind; i < argc; ++i) {
+		if (parse_file(&trie, argv[i]) < 0) {
+			return 1;
+		}
+	}
+
+	if (write_trie(&trie, output) < 0) {
+		return 1;
+	}
+
+	printf("%s: %zu nodes, %zu entries\n", output, trie.node_count,
+	    trie.record_count);
+	return 0;
+}
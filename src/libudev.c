@@ -1,23 +1,46 @@
 #define _GNU_SOURCE
 
+/* Must precede libudev.h, it renames the public functions when tracing. */
+#include "trace.h"
+
 #include "libudev.h"
+#include "broker.h"
+#include "hwdb.h"
 
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/un.h>
 
+#include <ctype.h>
 #include <errno.h>
+#include <fnmatch.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 
 #include <fcntl.h>
 #include <unistd.h>
 
+#if defined(HAVE_SYS_INOTIFY_H)
+#include <sys/inotify.h>
+#elif defined(HAVE_SYS_EVENT_H) && defined(O_PATH)
+#include <sys/event.h>
+#define USE_KQUEUE
+#endif
+
 #include <libevdev/libevdev.h>
 /* IWYU pragma: no_include <dev/evdev/input-event-codes.h> */
 
@@ -28,45 +51,382 @@
 #define LOG(...)
 #endif
 
+/*
+ * Probe results are shared between processes through a small snapshot file.
+ * Records are keyed by (devnum, inode, ctime) of the device node, so a node
+ * that was destroyed and recreated never matches a stale record.  The file
+ * is replaced atomically with rename(2); readers keep using their mapping
+ * of the old file until they miss and remap.  Writers take an flock(2) on
+ * a lock file next to it.  Within a process, the mapping is guarded by
+ * udev->lock.
+ */
+#ifndef SNAPSHOT_PATH
+#define SNAPSHOT_PATH "/var/run/libudev-fbsd.snapshot"
+#endif
+#define SNAPSHOT_MAGIC 0x76656475u /* "udev" */
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_MAX_RECORDS 128
+
+/*
+ * Everything a single probe learns about an event device.  Sysattrs and the
+ * ID_INPUT_* classification are derived from this, so the node never has to
+ * be opened twice.
+ */
+#define CAPS_WORDS(max) ((max) / 64 + 1)
+struct input_caps {
+	uint16_t bustype;
+	uint16_t vendor;
+	uint16_t product;
+	uint16_t version;
+	char name[128];
+	char phys[64];
+	char uniq[64];
+	uint64_t ev[CAPS_WORDS(EV_MAX)];
+	uint64_t key[CAPS_WORDS(KEY_MAX)];
+	uint64_t rel[CAPS_WORDS(REL_MAX)];
+	uint64_t abs[CAPS_WORDS(ABS_MAX)];
+	uint64_t msc[CAPS_WORDS(MSC_MAX)];
+	uint64_t led[CAPS_WORDS(LED_MAX)];
+	uint64_t snd[CAPS_WORDS(SND_MAX)];
+	uint64_t ff[CAPS_WORDS(FF_MAX)];
+	uint64_t sw[CAPS_WORDS(SW_MAX)];
+	uint64_t prop[CAPS_WORDS(INPUT_PROP_MAX)];
+};
+
+struct snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t reserved;
+};
+struct snapshot_record {
+	uint64_t devnum;
+	uint64_t ino;
+	int64_t ctime_sec;
+	int64_t ctime_nsec;
+	uint32_t input_class;
+	uint32_t reserved;
+	struct input_caps caps;
+};
+
+/*
+ * A device serialized by udev_device_serialize(): this header, prop_count
+ * pairs of name and value offsets, and the strings they point to.  Offsets
+ * are relative to the start of the record, so it can be mapped anywhere.
+ * Records are zero-padded to a multiple of 8 bytes, which keeps caps
+ * aligned in concatenated records and terminates the last string.
+ */
+#define DEVICE_BUFFER_MAGIC 0x62766564u /* "devb" */
+#define DEVICE_BUFFER_VERSION 1
+
+struct device_buffer {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t prop_count;
+	uint64_t devnum;
+	char syspath[32];
+	uint32_t input_class;
+	uint32_t reserved;
+	struct input_caps caps;
+};
+
+enum {
+	INPUT_CLASS_INPUT = 1 << 0,
+	INPUT_CLASS_TOUCHPAD = 1 << 1,
+	INPUT_CLASS_MOUSE = 1 << 2,
+	INPUT_CLASS_KEYBOARD = 1 << 3,
+	INPUT_CLASS_JOYSTICK = 1 << 4,
+};
+static char const *const input_class_names[] = {"ID_INPUT",
+    "ID_INPUT_TOUCHPAD", "ID_INPUT_MOUSE", "ID_INPUT_KEYBOARD",
+    "ID_INPUT_JOYSTICK"};
+#define INPUT_CLASS_COUNT                                                     \
+	(sizeof(input_class_names) / sizeof(input_class_names[0]))
+
+/* Capability bitmaps by event type, in the order of the sysfs attributes. */
+static struct {
+	char const *sysattr;
+	unsigned type;
+	unsigned max;
+	size_t offset;
+} const caps_bitmaps[] = {
+    {"capabilities/ev", EV_MAX + 1, EV_MAX, offsetof(struct input_caps, ev)},
+    {"capabilities/key", EV_KEY, KEY_MAX, offsetof(struct input_caps, key)},
+    {"capabilities/rel", EV_REL, REL_MAX, offsetof(struct input_caps, rel)},
+    {"capabilities/abs", EV_ABS, ABS_MAX, offsetof(struct input_caps, abs)},
+    {"capabilities/msc", EV_MSC, MSC_MAX, offsetof(struct input_caps, msc)},
+    {"capabilities/led", EV_LED, LED_MAX, offsetof(struct input_caps, led)},
+    {"capabilities/snd", EV_SND, SND_MAX, offsetof(struct input_caps, snd)},
+    {"capabilities/ff", EV_FF, FF_MAX, offsetof(struct input_caps, ff)},
+    {"capabilities/sw", EV_SW, SW_MAX, offsetof(struct input_caps, sw)},
+    {"properties", EV_MAX + 2, INPUT_PROP_MAX,
+	offsetof(struct input_caps, prop)},
+};
+#define CAPS_BITMAPS_COUNT (sizeof(caps_bitmaps) / sizeof(caps_bitmaps[0]))
+
+/* Sysattrs that are formatted on first access and cached on the device. */
+static char const *const id_sysattrs[] = {
+    "id/bustype", "id/vendor", "id/product", "id/version"};
+#define ID_SYSATTRS_COUNT (sizeof(id_sysattrs) / sizeof(id_sysattrs[0]))
+#define CACHED_SYSATTRS_COUNT (ID_SYSATTRS_COUNT + CAPS_BITMAPS_COUNT)
+
+/*
+ * Tag rules, read once per context from TAGS_PATH.  Each line assigns tags
+ * and a seat to the devices matching all of its patterns, e.g.
+ *
+ *   vendor=046d phys="usb-0000:00:14.0-2*" seat=seat1 tag=uaccess
+ *
+ * name, phys and vendor (four hex digits) are fnmatch(3) patterns; tag
+ * takes a comma-separated list.  Assigning a seat adds the "seat" tag.
+ * Later lines override the seat of earlier ones.
+ */
+#define TAGS_MAX 32
+
+struct tag_rule {
+	char *name;
+	char *phys;
+	char *vendor;
+	uint32_t tags;
+	char *seat;
+};
+
+/*
+ * Tags and seat of each event node, valid while the node's (devnum, inode,
+ * ctime) stays the same.  Filled in by every probe, so a tag match only
+ * has to stat nodes that were seen before.
+ */
+struct tag_index_entry {
+	bool valid;
+	uint64_t devnum;
+	uint64_t ino;
+	int64_t ctime_sec;
+	int64_t ctime_nsec;
+	uint32_t tags;
+	char const *seat;
+};
+
+/*
+ * A devd connection serviced by its own thread.  Input CREATE and DESTROY
+ * events are passed to on_event as "+input/eventN" and "-input/eventN".
+ */
+struct devd_listener {
+	int socket;
+	int quit_fds[2];
+	pthread_t thread;
+	bool running;
+	void (*on_event)(void *arg, char const *msg);
+	/* Optional: called once the connection is back after devd or the
+	 * broker went away.  Events in between are lost, the callback has
+	 * to rescan. */
+	void (*on_reconnect)(void *arg);
+	void *arg;
+	/*
+	 * Nodes announced before they can be opened; devd reports a node
+	 * before devfs rules set its permissions.  on_retry is called for
+	 * them when a change of their attributes is seen on wakeup_fd
+	 * (inotify or kqueue) or, for nodes that could not be watched, once
+	 * a second.  Owned by the listener thread once it runs.
+	 */
+	int wakeup_fd;
+	void (*on_retry)(void *arg, unsigned node);
+	bool pending[100];
+	int pending_watch[100];
+};
+
+/*
+ * Immutable, refcounted set of present event nodes, sorted by number.
+ * Updates publish a new set; enumerations keep the one they acquired.
+ */
+struct live_set {
+	atomic_int refcount;
+	unsigned count;
+	unsigned nodes[];
+};
+
 struct udev {
-	int refcount;
+	atomic_int refcount;
+	pthread_mutex_t lock; /* protects the snapshot, hwdb, parents and
+			       * the fd cache */
+	struct udev_device *parents;
+	void *hwdb;
+	size_t hwdb_size;
+	/* Set once the hwdb was looked for; hwdb is fixed from then on and
+	 * can be read without the lock. */
+	atomic_bool hwdb_checked;
+	void *snapshot;
+	size_t snapshot_size;
+	ino_t snapshot_ino;
+	bool live_enabled;
+	struct devd_listener live_listener;
+	_Atomic(struct live_set *) live_set;
+	atomic_int live_readers;
+	/* Probe descriptors kept for udev_device_take_fd(), newest first. */
+	unsigned fd_cache_max;
+	uint64_t fd_idle_usec;
+	unsigned fd_cache_count;
+	struct udev_device *fd_cache;
+	/* Immutable once rules_checked is set. */
+	bool rules_checked;
+	struct tag_rule *rules;
+	unsigned rule_count;
+	char *tag_names[TAGS_MAX];
+	unsigned tag_count;
+	struct tag_index_entry tag_index[100];
 };
+enum { PROBE_NONE, PROBE_RUNNING, PROBE_DONE };
+
+/*
+ * Devices are immutable once they are handed out; only the probe results,
+ * the property list, the parent and the formatted sysattrs are filled in
+ * lazily and published with release/acquire ordering.  Together with the
+ * atomic refcounts, this lets devices be shared between threads.
+ */
 struct udev_device {
 	struct udev *udev;
-	int refcount;
+	atomic_int refcount;
 	char syspath[32];
 	dev_t devnum;
 	char const *sysname;
 	char const *action;
 	char const *subsystem;
-	struct udev_list_entry *properties_list;
-	struct udev_device *parent;
+	char const *devtype;
+	/* Filled in by device_probe() on first use; read them only after
+	 * it returned. */
+	atomic_int probe_state;
+	int probe_error;
+	bool uninitialized;
+	struct input_caps *caps;
+	/* ID_INPUT_* flags of probed devices.  Their property list is only
+	 * built when it is asked for; parents fill it in right away. */
+	uint32_t input_class;
+	/* Bits into udev->tag_names and the ID_SEAT assigned by the rules.
+	 * Also set on remove events, from the tag index. */
+	uint32_t tags;
+	char const *seat;
+	_Atomic(struct udev_list_entry *) properties_list;
+	/* Set on devices delivered by a monitor. */
+	unsigned long long seqnum;
+	uint64_t usec_initialized;
+	_Atomic(char *) sysattrs[CACHED_SYSATTRS_COUNT];
+	_Atomic(struct udev_device *) parent;
+	bool is_parent;
+	/* Interned parents are linked into udev->parents. */
+	bool interned;
+	struct udev_device *next_interned;
+	/* Descriptor left open by the probe, linked into udev->fd_cache.
+	 * Protected by udev->lock. */
+	bool fd_cached;
+	int fd;
+	uint64_t fd_usec;
+	struct udev_device *next_fd;
+	/* Set on devices wrapping a serialized record.  caps and the
+	 * property strings point into it. */
+	struct device_buffer const *buffer;
 };
+/*
+ * Property entries are allocated one by one, with name and value stored
+ * right behind the entry.  Enumerate results are one array of entries, see
+ * struct udev_enumerate.
+ */
 struct udev_list_entry {
-	char name[32];
-	int has_value;
-	char value[32];
+	char const *name;
+	char const *value;
 	struct udev_list_entry *next;
 };
 struct udev_monitor {
 	struct udev *udev;
-	int refcount;
+	atomic_int refcount;
 	int scan_for_input;
+	/* Tags an event's device must carry; no_match for unknown tags. */
+	uint32_t match_tags;
+	bool no_match;
 	int pipe_fds[2];
-	pthread_t devd_thread;
-	int devd_socket;
-	int is_receiving;
+	struct devd_listener devd;
+	/* Nodes already reported by udev_enumerate_scan_devices_with_monitor;
+	 * their first add event is suppressed.  Owned by the listener
+	 * thread once it runs. */
+	bool snapshot_nodes[100];
+	/* Adds of nodes pending in devd are withheld until the probe
+	 * succeeds; this is when devd reported them. */
+	uint64_t pending_usec[100];
+	/* Nodes the consumer has seen added and not removed, counting the
+	 * ones present when receiving started.  Owned by the listener
+	 * thread; after a reconnect the events missed meanwhile are
+	 * derived from it. */
+	bool present[100];
+	/* Sequence number of the last event written to the pipe, including
+	 * ones dropped because the pipe was full or lost while devd was
+	 * unreachable. */
+	unsigned long long seqnum;
 };
+/*
+ * Scan results live in a single allocation: dev_count entries linked in
+ * array order, followed by their syspaths.  The array is sorted by sysname,
+ * comparing digit runs by value, so it can be indexed and searched.
+ */
 struct udev_enumerate {
-	int refcount;
+	struct udev *udev;
+	atomic_int refcount;
 	int scan_for_input;
-	struct udev_list_entry *dev_list;
+	/* Tag and seat filters, answered from the tag index; no_match for
+	 * unknown tags. */
+	uint32_t match_tags;
+	char *match_seat;
+	bool no_match;
+	struct udev_list_entry *devs;
+	size_t dev_count;
 };
 
 static struct udev_list_entry *create_list_entry_name_value(
     char const *name, char const *value);
-static struct udev_list_entry *create_list_entry_name(char const *name);
 static void free_dev_list(struct udev_list_entry **list);
+static void snapshot_unmap(struct udev *udev);
+static void fd_cache_trim(struct udev *udev, unsigned limit);
+static void rules_free(struct udev *udev);
+static bool udev_has_hwdb(struct udev *udev);
+static int device_probe(struct udev_device *udev_device);
+static struct udev_list_entry *device_properties(
+    struct udev_device *udev_device);
+static void udev_device_free(struct udev_device *udev_device);
+static int append_property(
+    struct udev_list_entry ***end, char const *name, char const *value);
+static char const *buffer_property_value(
+    struct device_buffer const *buffer, char const *property);
+static void devd_listener_connect(struct devd_listener *listener);
+static int devd_listener_start(struct devd_listener *listener);
+static void devd_listener_fini(struct devd_listener *listener);
+static void live_set_release(struct live_set *set);
+static struct live_set *live_set_acquire(struct udev *udev);
+static void monitor_on_event(void *arg, char const *msg);
+static void monitor_on_retry(void *arg, unsigned node);
+static void monitor_on_reconnect(void *arg);
+
+static void
+refcount_inc(atomic_int *refcount)
+{
+	atomic_fetch_add_explicit(refcount, 1, memory_order_relaxed);
+}
+
+/* Returns true when the last reference was dropped. */
+static bool
+refcount_dec(atomic_int *refcount)
+{
+	if (atomic_fetch_sub_explicit(refcount, 1, memory_order_release) !=
+	    1) {
+		return false;
+	}
+	atomic_thread_fence(memory_order_acquire);
+	return true;
+}
+
+static uint64_t
+now_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
 
 struct udev *
 udev_new(void)
@@ -74,7 +434,12 @@ udev_new(void)
 	LOG("udev_new\n");
 	struct udev *u = calloc(1, sizeof(struct udev));
 	if (u) {
-		u->refcount = 1;
+		if (pthread_mutex_init(&u->lock, NULL) != 0) {
+			free(u);
+			return NULL;
+		}
+		atomic_init(&u->refcount, 1);
+		atomic_init(&u->hwdb_checked, false);
 		return u;
 	}
 	return NULL;
@@ -84,16 +449,45 @@ struct udev *
 udev_ref(struct udev *udev)
 {
 	LOG("udev_ref\n");
-	++udev->refcount;
+	refcount_inc(&udev->refcount);
 	return udev;
 }
 
+/*
+ * Devices, enumerates and monitors keep their context alive: they use its
+ * lock, caches and parents until they are freed, and callers may drop the
+ * context first.  A NULL context is tolerated, as everywhere else.
+ */
+static struct udev *
+context_ref(struct udev *udev)
+{
+	return udev ? udev_ref(udev) : NULL;
+}
+
+static void
+context_unref(struct udev *udev)
+{
+	if (udev) {
+		udev_unref(udev);
+	}
+}
+
 void
 udev_unref(struct udev *udev)
 {
 	LOG("udev_unref\n");
-	--udev->refcount;
-	if (udev->refcount == 0) {
+	if (refcount_dec(&udev->refcount)) {
+		if (udev->live_enabled) {
+			devd_listener_fini(&udev->live_listener);
+			live_set_release(atomic_load(&udev->live_set));
+		}
+		fd_cache_trim(udev, 0);
+		snapshot_unmap(udev);
+		rules_free(udev);
+		if (udev->hwdb) {
+			munmap(udev->hwdb, udev->hwdb_size);
+		}
+		pthread_mutex_destroy(&udev->lock);
 		free(udev);
 	}
 }
@@ -144,7 +538,27 @@ udev_device_get_property_value(struct udev_device *dev, char const *property)
 	LOG("udev_device_get_property_value %s\n", property);
 	struct udev_list_entry *entry;
 
-	udev_list_entry_foreach(entry, dev->properties_list)
+	/* Answer the common queries without building the list. */
+	if (!dev->is_parent) {
+		if (device_probe(dev) < 0) {
+			return NULL;
+		}
+		for (unsigned i = 0; i < INPUT_CLASS_COUNT; ++i) {
+			if ((dev->input_class & (1u << i)) &&
+			    strcmp(property, input_class_names[i]) == 0) {
+				return "1";
+			}
+		}
+		if (dev->buffer) {
+			return buffer_property_value(dev->buffer, property);
+		}
+		if (!dev->udev ||
+		    (!udev_has_hwdb(dev->udev) && !dev->tags && !dev->seat)) {
+			return NULL;
+		}
+	}
+
+	udev_list_entry_foreach(entry, device_properties(dev))
 	{
 		if (strcmp(entry->name, property) == 0) {
 			return entry->value;
@@ -161,479 +575,2882 @@ udev_device_get_udev(struct udev_device *udev_device)
 	return udev_device->udev;
 }
 
-static int
-populate_properties_list(struct udev_device *udev_device)
+static void
+snapshot_unmap(struct udev *udev)
 {
-	int ret = 0;
-
-	char const *ids[] = {"ID_INPUT", "ID_INPUT_TOUCHPAD", "ID_INPUT_MOUSE",
-	    "ID_INPUT_KEYBOARD", "ID_INPUT_JOYSTICK"};
+	if (udev->snapshot) {
+		munmap(udev->snapshot, udev->snapshot_size);
+		udev->snapshot = NULL;
+		udev->snapshot_size = 0;
+		udev->snapshot_ino = 0;
+	}
+}
 
-	int fd = open(udev_device->syspath, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+static void
+snapshot_map(struct udev *udev)
+{
+	int fd = open(SNAPSHOT_PATH, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
 	if (fd < 0) {
-		return -1;
+		return;
 	}
 
-	struct libevdev *evdev = NULL;
-	if (libevdev_new_from_fd(fd, &evdev) != 0) {
-		LOG("udev_device_get_property_value: could not "
-		    "create evdev\n");
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_ino == udev->snapshot_ino ||
+	    (size_t)st.st_size < sizeof(struct snapshot_header)) {
 		close(fd);
-		return -1;
-	}
-
-	struct udev_list_entry **list_end = &udev_device->properties_list;
-
-	for (unsigned i = 0; i < (sizeof((ids)) / sizeof((ids)[0])); ++i) {
-		char const *id = ids[i];
-		struct udev_list_entry *le;
-
-		if (strcmp(id, "ID_INPUT") == 0) {
-			le = create_list_entry_name_value(id, "1");
-		} else if (strcmp(id, "ID_INPUT_TOUCHPAD") == 0) {
-			if (libevdev_has_event_code(evdev, EV_ABS, ABS_X) &&
-			    libevdev_has_event_code(evdev, EV_ABS, ABS_Y) &&
-			    libevdev_has_event_code(
-				evdev, EV_KEY, BTN_TOOL_FINGER) &&
-			    !libevdev_has_event_code(
-				evdev, EV_KEY, BTN_STYLUS) &&
-			    !libevdev_has_event_code(
-				evdev, EV_KEY, BTN_TOOL_PEN)) {
-				le = create_list_entry_name_value(id, "1");
-			} else {
-				continue;
-			}
-		} else if (strcmp(id, "ID_INPUT_MOUSE") == 0) {
-			int is_mouse = 0;
-			if (libevdev_has_event_code(evdev, EV_REL, REL_X) &&
-			    libevdev_has_event_code(evdev, EV_REL, REL_Y) &&
-			    libevdev_has_event_code(
-				evdev, EV_KEY, BTN_MOUSE)) {
-				is_mouse = 1;
-			}
-			if (libevdev_has_event_code(evdev, EV_ABS, ABS_X) &&
-			    libevdev_has_event_code(evdev, EV_ABS, ABS_Y) &&
-			    !libevdev_has_event_code(
-				evdev, EV_KEY, BTN_TOOL_FINGER) &&
-			    !libevdev_has_event_code(
-				evdev, EV_KEY, BTN_STYLUS) &&
-			    !libevdev_has_event_code(
-				evdev, EV_KEY, BTN_TOOL_PEN) &&
-			    libevdev_has_event_code(
-				evdev, EV_KEY, BTN_MOUSE)) {
-				is_mouse = 1;
-			}
-			if (is_mouse) {
-				le = create_list_entry_name_value(id, "1");
-			} else {
-				continue;
-			}
-		} else if (strcmp(id, "ID_INPUT_KEYBOARD") == 0) {
-			bool is_keyboard = true;
-			for (unsigned k = KEY_ESC; k <= KEY_D; ++k) {
-				if (!libevdev_has_event_code(
-					evdev, EV_KEY, k)) {
-					is_keyboard = false;
-					break;
-				}
-			}
-			if (is_keyboard) {
-				le = create_list_entry_name_value(id, "1");
-			} else {
-				continue;
-			}
-		} else if (strcmp(id, "ID_INPUT_JOYSTICK") == 0) {
-			// TODO(jan): implement udev logic more faithfully
-			bool is_joystick = false;
-			if (libevdev_has_event_code(evdev, EV_ABS, ABS_X) &&
-			    libevdev_has_event_code(evdev, EV_ABS, ABS_Y) &&
-			    (libevdev_has_event_code(
-				 evdev, EV_KEY, BTN_TRIGGER) ||
-				libevdev_has_event_code(
-				    evdev, EV_KEY, BTN_A) ||
-				libevdev_has_event_code(
-				    evdev, EV_KEY, BTN_1) ||
-				libevdev_has_event_code(
-				    evdev, EV_ABS, ABS_RX) ||
-				libevdev_has_event_code(
-				    evdev, EV_ABS, ABS_RY) ||
-				libevdev_has_event_code(
-				    evdev, EV_ABS, ABS_RZ) ||
-				libevdev_has_event_code(
-				    evdev, EV_ABS, ABS_THROTTLE) ||
-				libevdev_has_event_code(
-				    evdev, EV_ABS, ABS_RUDDER) ||
-				libevdev_has_event_code(
-				    evdev, EV_ABS, ABS_WHEEL) ||
-				libevdev_has_event_code(
-				    evdev, EV_ABS, ABS_GAS) ||
-				libevdev_has_event_code(
-				    evdev, EV_ABS, ABS_BRAKE))) {
-				is_joystick = true;
-			}
-			if (is_joystick) {
-				le = create_list_entry_name_value(id, "1");
-			} else {
-				continue;
-			}
-		} else {
-			continue;
-		}
-
-		if (!le) {
-			free_dev_list(&udev_device->properties_list);
-			ret = -1;
-			goto out;
-		}
-
-		while (*list_end) {
-			list_end = &((*list_end)->next);
-		}
-
-		*list_end = le;
+		return;
 	}
 
-out:
-	libevdev_free(evdev);
+	void *map = mmap(
+	    NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
 	close(fd);
+	if (map == MAP_FAILED) {
+		return;
+	}
 
-	return ret;
-}
-
-static struct udev_device *
-udev_device_new_from_syspath_impl(
-    struct udev *udev, const char *syspath, bool do_open)
-{
-	LOG("udev_device_new_from_syspath %s\n", syspath);
-	struct udev_device *u = calloc(1, sizeof(struct udev_device));
-	if (u) {
-		if (do_open) {
-			struct stat st;
-			if (stat(syspath, &st) == 0) {
-				u->devnum = st.st_rdev;
-			} else {
-				free(u);
-				return NULL;
-			}
-		}
-
-		// TODO(jan): increase refcount?
-		u->udev = udev;
-		u->refcount = 1;
-		snprintf(u->syspath, sizeof(u->syspath), "%s", syspath);
-		u->sysname = (char const *)u->syspath + 11;
-		u->subsystem = "input";
-
-		if (do_open && populate_properties_list(u) < 0) {
-			udev_device_unref(u);
-			return NULL;
-		}
-
-		return u;
+	struct snapshot_header const *hdr = map;
+	if (hdr->magic != SNAPSHOT_MAGIC || hdr->version != SNAPSHOT_VERSION ||
+	    hdr->count > SNAPSHOT_MAX_RECORDS ||
+	    sizeof(*hdr) + hdr->count * sizeof(struct snapshot_record) >
+		(size_t)st.st_size) {
+		munmap(map, (size_t)st.st_size);
+		return;
 	}
-	return NULL;
-}
 
-struct udev_device *
-udev_device_new_from_syspath(struct udev *udev, const char *syspath)
-{
-	return udev_device_new_from_syspath_impl(udev, syspath, true);
+	snapshot_unmap(udev);
+	udev->snapshot = map;
+	udev->snapshot_size = (size_t)st.st_size;
+	udev->snapshot_ino = st.st_ino;
 }
 
-const char *
-udev_device_get_syspath(struct udev_device *udev_device)
+static bool
+snapshot_record_matches(
+    struct snapshot_record const *rec, struct stat const *st)
 {
-	LOG("udev_device_get_syspath\n");
-	return udev_device->syspath;
+	return rec->devnum == (uint64_t)st->st_rdev &&
+	    rec->ino == (uint64_t)st->st_ino &&
+	    rec->ctime_sec == (int64_t)st->st_ctim.tv_sec &&
+	    rec->ctime_nsec == (int64_t)st->st_ctim.tv_nsec;
 }
 
-const char *
-udev_device_get_sysname(struct udev_device *udev_device)
+static struct snapshot_record const *
+snapshot_find(struct udev *udev, struct stat const *st)
 {
-	LOG("udev_device_get_sysname\n");
-	return udev_device->sysname;
-}
+	if (!udev->snapshot) {
+		return NULL;
+	}
 
-const char *
-udev_device_get_subsystem(struct udev_device *udev_device)
-{
-	LOG("udev_device_get_subsystem\n");
-	return udev_device->subsystem;
-}
+	struct snapshot_header const *hdr = udev->snapshot;
+	struct snapshot_record const *recs =
+	    (struct snapshot_record const *)(hdr + 1);
+
+	for (uint32_t i = 0; i < hdr->count; ++i) {
+		if (snapshot_record_matches(&recs[i], st)) {
+			return &recs[i];
+		}
+	}
 
-const char *
-udev_device_get_sysattr_value(
-    struct udev_device *udev_device, const char *sysattr)
-{
-	(void)udev_device;
-	(void)sysattr;
-	LOG("stub: udev_device_get_sysattr_value %s\n", sysattr);
 	return NULL;
 }
 
-struct udev_list_entry *
-udev_device_get_properties_list_entry(struct udev_device *udev_device)
+static int
+snapshot_lookup(struct udev *udev, struct stat const *st,
+    uint32_t *input_class, struct input_caps *caps)
 {
-	LOG("udev_device_get_properties_list_entry\n");
-	return udev_device->properties_list;
-}
+	struct snapshot_record const *rec = snapshot_find(udev, st);
+	if (!rec) {
+		/* Another process may have replaced the file since we mapped
+		 * it. */
+		snapshot_map(udev);
+		rec = snapshot_find(udev, st);
+	}
+	if (!rec) {
+		return -1;
+	}
 
-struct udev_device *
-udev_device_ref(struct udev_device *udev_device)
-{
-	LOG("udev_device_ref\n");
-	++udev_device->refcount;
-	return udev_device;
+	*input_class = rec->input_class;
+	*caps = rec->caps;
+	return 0;
 }
 
-void
-udev_device_unref(struct udev_device *udev_device)
+/*
+ * Adds a record for a node.  Writers serialize on a lock file and merge
+ * with the file as it is under the lock, so concurrent writers in other
+ * processes keep each other's records.  Called with udev->lock held.
+ */
+static void
+snapshot_store(struct udev *udev, struct stat const *st, uint32_t input_class,
+    struct input_caps const *caps)
 {
-	LOG("udev_device_unref %p %d\n", (void *)udev_device,
-	    udev_device->refcount);
+	int lock_fd = open(SNAPSHOT_PATH ".lock",
+	    O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0644);
+	if (lock_fd < 0) {
+		/* Unprivileged processes can only read the snapshot. */
+		return;
+	}
+	if (flock(lock_fd, LOCK_EX) != 0) {
+		close(lock_fd);
+		return;
+	}
 
-	--udev_device->refcount;
-	if (udev_device->refcount == 0) {
-		if (udev_device->parent) {
-			free(udev_device->parent);
-			udev_device->parent = NULL;
-		}
-		free_dev_list(&udev_device->properties_list);
-		free(udev_device);
+	/* Another writer may have replaced the file, possibly with this
+	 * very record, since we mapped it. */
+	snapshot_map(udev);
+	if (snapshot_find(udev, st)) {
+		goto out;
 	}
-}
 
-struct udev_device *
-udev_device_get_parent(struct udev_device *udev_device)
-{
-	LOG("udev_device_get_parent %p %d\n", (void *)udev_device,
-	    udev_device->refcount);
+	struct snapshot_header const *old_hdr = udev->snapshot;
+	uint32_t old_count = old_hdr ? old_hdr->count : 0;
+	uint32_t max = old_count < SNAPSHOT_MAX_RECORDS ? old_count + 1
+							: SNAPSHOT_MAX_RECORDS;
+	struct snapshot_record *recs =
+	    calloc(max, sizeof(struct snapshot_record));
+	uint32_t count = 0;
 
-	if (udev_device->parent) {
-		return udev_device->parent;
+	if (!recs) {
+		goto out;
 	}
 
-	udev_device->parent = calloc(1, sizeof(struct udev_device));
-	if (!udev_device->parent) {
-		return NULL;
+	recs[count++] = (struct snapshot_record){
+	    .devnum = (uint64_t)st->st_rdev,
+	    .ino = (uint64_t)st->st_ino,
+	    .ctime_sec = (int64_t)st->st_ctim.tv_sec,
+	    .ctime_nsec = (int64_t)st->st_ctim.tv_nsec,
+	    .input_class = input_class,
+	    .caps = *caps,
+	};
+
+	/* Carry over all records except stale ones for the same device. */
+	if (old_hdr) {
+		struct snapshot_record const *old =
+		    (struct snapshot_record const *)(old_hdr + 1);
+		for (uint32_t i = 0; i < old_count && count < max; ++i) {
+			if (old[i].devnum != (uint64_t)st->st_rdev) {
+				recs[count++] = old[i];
+			}
+		}
 	}
 
-	int fd = open(udev_device->syspath, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	char tmp_path[] = SNAPSHOT_PATH ".XXXXXX";
+	int fd = mkostemp(tmp_path, O_CLOEXEC);
 	if (fd < 0) {
-		goto free_parent;
-	}
-
-	struct libevdev *evdev = NULL;
-	if (libevdev_new_from_fd(fd, &evdev) != 0) {
-		LOG("udev_device_get_parent: could not create evdev\n");
-		goto free_fd;
+		free(recs);
+		goto out;
 	}
 
-	struct udev_list_entry *le =
-	    create_list_entry_name_value("NAME", libevdev_get_name(evdev));
-	if (!le) {
-		goto free_evdev;
+	struct snapshot_header hdr = {
+	    .magic = SNAPSHOT_MAGIC,
+	    .version = SNAPSHOT_VERSION,
+	    .count = count,
+	};
+	size_t recs_size = count * sizeof(struct snapshot_record);
+
+	if (fchmod(fd, 0644) != 0 ||
+	    write(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) ||
+	    write(fd, recs, recs_size) != (ssize_t)recs_size ||
+	    rename(tmp_path, SNAPSHOT_PATH) != 0) {
+		unlink(tmp_path);
+		close(fd);
+		free(recs);
+		goto out;
 	}
 
-	udev_device->parent->properties_list = le;
-	libevdev_free(evdev);
 	close(fd);
-	return udev_device->parent;
+	free(recs);
+	snapshot_map(udev);
 
-free_evdev:
-	libevdev_free(evdev);
-free_fd:
-	close(fd);
-free_parent:
-	free(udev_device->parent);
-	udev_device->parent = NULL;
-	return NULL;
+out:
+	flock(lock_fd, LOCK_UN);
+	close(lock_fd);
 }
 
-int
-udev_device_get_is_initialized(struct udev_device *udev_device)
+static void
+caps_set(uint64_t *bits, unsigned code)
 {
-	(void)udev_device;
-	LOG("udev_device_get_is_initialized %p %d\n", (void *)udev_device,
-	    udev_device->refcount);
-	return 1;
+	bits[code / 64] |= UINT64_C(1) << (code % 64);
 }
 
-const char *
-udev_device_get_action(struct udev_device *udev_device)
+static bool
+caps_test(uint64_t const *bits, unsigned code)
 {
-	LOG("stub: udev_device_get_action\n");
-	return udev_device->action;
+	return (bits[code / 64] >> (code % 64)) & 1;
 }
 
-struct udev_device *
-udev_device_get_parent_with_subsystem_devtype(struct udev_device *udev_device,
-    char const *subsystem, char const *devtype)
+static uint64_t const *
+caps_bitmap(struct input_caps const *caps, unsigned i)
 {
-	(void)udev_device;
-	(void)subsystem;
-	(void)devtype;
-	LOG("stub: udev_device_get_parent_with_subsystem_devtype %s %s\n",
-	    subsystem, devtype);
-	return NULL;
+	return (uint64_t const *)((char const *)caps + caps_bitmaps[i].offset);
 }
 
-struct udev_enumerate *
-udev_enumerate_new(struct udev *udev)
+static bool
+caps_has(struct input_caps const *caps, unsigned type, unsigned code)
 {
-	(void)udev;
-	LOG("udev_enumerate_new\n");
-	struct udev_enumerate *u = calloc(1, sizeof(struct udev_enumerate));
-	if (u) {
-		u->refcount = 1;
-		return u;
+	for (unsigned i = 0; i < CAPS_BITMAPS_COUNT; ++i) {
+		if (caps_bitmaps[i].type == type) {
+			return code <= caps_bitmaps[i].max &&
+			    caps_test(caps_bitmap(caps, i), code);
+		}
 	}
-	return NULL;
+	return false;
 }
 
-int
-udev_enumerate_add_match_subsystem(
-    struct udev_enumerate *udev_enumerate, const char *subsystem)
+/*
+ * Gathers names, ids and all capability bitmaps with a single open.  If
+ * keep_fd is set, the node is opened read-write where permitted, the way
+ * a consumer would, and the descriptor is returned instead of closed.
+ */
+static int
+probe_input_caps(char const *devnode, struct input_caps *caps, int *keep_fd)
 {
-	LOG("udev_enumerate_add_match_subsystem\n");
-	if (strcmp(subsystem, "input") != 0) {
+	int fd = -1;
+	if (keep_fd) {
+		fd = open(devnode, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	}
+	if (fd < 0) {
+		fd = open(devnode, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	}
+	if (fd < 0) {
 		return -1;
 	}
 
-	udev_enumerate->scan_for_input = 1;
-	return 0;
-}
+	struct libevdev *evdev = NULL;
+	if (libevdev_new_from_fd(fd, &evdev) != 0) {
+		LOG("udev_device_get_property_value: could not "
+		    "create evdev\n");
+		close(fd);
+		errno = ENODEV;
+		return -1;
+	}
 
-int
-udev_enumerate_scan_devices(struct udev_enumerate *udev_enumerate)
-{
-	LOG("udev_enumerate_scan_devices\n");
+	memset(caps, 0, sizeof(*caps));
+	caps->bustype = (uint16_t)libevdev_get_id_bustype(evdev);
+	caps->vendor = (uint16_t)libevdev_get_id_vendor(evdev);
+	caps->product = (uint16_t)libevdev_get_id_product(evdev);
+	caps->version = (uint16_t)libevdev_get_id_version(evdev);
 
-	if (!udev_enumerate->scan_for_input) {
-		return 0;
+	char const *str;
+	if ((str = libevdev_get_name(evdev))) {
+		snprintf(caps->name, sizeof(caps->name), "%s", str);
 	}
-
+	if ((str = libevdev_get_phys(evdev))) {
+		snprintf(caps->phys, sizeof(caps->phys), "%s", str);
+	}
+	if ((str = libevdev_get_uniq(evdev))) {
+		snprintf(caps->uniq, sizeof(caps->uniq), "%s", str);
+	}
+
+	for (unsigned type = 0; type <= EV_MAX; ++type) {
+		if (libevdev_has_event_type(evdev, type)) {
+			caps_set(caps->ev, type);
+		}
+	}
+	for (unsigned i = 0; i < CAPS_BITMAPS_COUNT; ++i) {
+		unsigned type = caps_bitmaps[i].type;
+		if (type > EV_MAX || !caps_test(caps->ev, type)) {
+			continue;
+		}
+		uint64_t *bits =
+		    (uint64_t *)((char *)caps + caps_bitmaps[i].offset);
+		for (unsigned code = 0; code <= caps_bitmaps[i].max; ++code) {
+			if (libevdev_has_event_code(evdev, type, code)) {
+				caps_set(bits, code);
+			}
+		}
+	}
+	for (unsigned prop = 0; prop <= INPUT_PROP_MAX; ++prop) {
+		if (libevdev_has_property(evdev, prop)) {
+			caps_set(caps->prop, prop);
+		}
+	}
+
+	libevdev_free(evdev);
+	if (keep_fd) {
+		*keep_fd = fd;
+	} else {
+		close(fd);
+	}
+
+	return 0;
+}
+
+static uint32_t
+classify_input_caps(struct input_caps const *caps)
+{
+	uint32_t cls = INPUT_CLASS_INPUT;
+
+	if (caps_has(caps, EV_ABS, ABS_X) && caps_has(caps, EV_ABS, ABS_Y) &&
+	    caps_has(caps, EV_KEY, BTN_TOOL_FINGER) &&
+	    !caps_has(caps, EV_KEY, BTN_STYLUS) &&
+	    !caps_has(caps, EV_KEY, BTN_TOOL_PEN)) {
+		cls |= INPUT_CLASS_TOUCHPAD;
+	}
+
+	if (caps_has(caps, EV_REL, REL_X) && caps_has(caps, EV_REL, REL_Y) &&
+	    caps_has(caps, EV_KEY, BTN_MOUSE)) {
+		cls |= INPUT_CLASS_MOUSE;
+	}
+	if (caps_has(caps, EV_ABS, ABS_X) && caps_has(caps, EV_ABS, ABS_Y) &&
+	    !caps_has(caps, EV_KEY, BTN_TOOL_FINGER) &&
+	    !caps_has(caps, EV_KEY, BTN_STYLUS) &&
+	    !caps_has(caps, EV_KEY, BTN_TOOL_PEN) &&
+	    caps_has(caps, EV_KEY, BTN_MOUSE)) {
+		cls |= INPUT_CLASS_MOUSE;
+	}
+
+	bool is_keyboard = true;
+	for (unsigned k = KEY_ESC; k <= KEY_D; ++k) {
+		if (!caps_has(caps, EV_KEY, k)) {
+			is_keyboard = false;
+			break;
+		}
+	}
+	if (is_keyboard) {
+		cls |= INPUT_CLASS_KEYBOARD;
+	}
+
+	// TODO(jan): implement udev logic more faithfully
+	if (caps_has(caps, EV_ABS, ABS_X) && caps_has(caps, EV_ABS, ABS_Y) &&
+	    (caps_has(caps, EV_KEY, BTN_TRIGGER) ||
+		caps_has(caps, EV_KEY, BTN_A) ||
+		caps_has(caps, EV_KEY, BTN_1) ||
+		caps_has(caps, EV_ABS, ABS_RX) ||
+		caps_has(caps, EV_ABS, ABS_RY) ||
+		caps_has(caps, EV_ABS, ABS_RZ) ||
+		caps_has(caps, EV_ABS, ABS_THROTTLE) ||
+		caps_has(caps, EV_ABS, ABS_RUDDER) ||
+		caps_has(caps, EV_ABS, ABS_WHEEL) ||
+		caps_has(caps, EV_ABS, ABS_GAS) ||
+		caps_has(caps, EV_ABS, ABS_BRAKE))) {
+		cls |= INPUT_CLASS_JOYSTICK;
+	}
+
+	return cls;
+}
+
+static void
+hwdb_load(struct udev *udev)
+{
+	int fd = open(HWDB_PATH, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 ||
+	    (size_t)st.st_size < sizeof(struct hwdb_header)) {
+		close(fd);
+		return;
+	}
+
+	void *map = mmap(
+	    NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return;
+	}
+
+	struct hwdb_header const *hdr = map;
+	size_t size = (size_t)st.st_size;
+	if (memcmp(hdr->magic, HWDB_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != HWDB_VERSION || hdr->file_size != size ||
+	    hdr->node_count == 0 || hdr->strings_size == 0 ||
+	    hdr->strings_off > size ||
+	    hdr->strings_size > size - hdr->strings_off ||
+	    ((char const *)map)[hdr->strings_off + hdr->strings_size - 1] !=
+		'\0') {
+		LOG("hwdb_map: invalid %s\n", HWDB_PATH);
+		munmap(map, size);
+		return;
+	}
+
+	udev->hwdb = map;
+	udev->hwdb_size = size;
+}
+
+/* Maps the compiled hwdb once per context.  Called with udev->lock held. */
+static void
+hwdb_map(struct udev *udev)
+{
+	if (atomic_load_explicit(&udev->hwdb_checked, memory_order_relaxed)) {
+		return;
+	}
+
+	hwdb_load(udev);
+	atomic_store_explicit(&udev->hwdb_checked, true, memory_order_release);
+}
+
+/* Returns a pointer into the hwdb if [off, off + count * size) is valid. */
+static void const *
+hwdb_array(struct udev const *udev, uint32_t off, uint32_t count, size_t size)
+{
+	if (off > udev->hwdb_size ||
+	    count > (udev->hwdb_size - off) / size) {
+		return NULL;
+	}
+	return (char const *)udev->hwdb + off;
+}
+
+static char const *
+hwdb_string(struct udev const *udev, uint32_t off)
+{
+	struct hwdb_header const *hdr = udev->hwdb;
+	if (off >= hdr->strings_size) {
+		return NULL;
+	}
+	return (char const *)udev->hwdb + hdr->strings_off + off;
+}
+
+struct hwdb_match {
+	char const *key;
+	char const *value;
+};
+
+static unsigned
+hwdb_add_props(struct udev const *udev, uint32_t off, uint32_t count,
+    struct hwdb_match *matches, unsigned n, unsigned max)
+{
+	struct hwdb_prop const *props =
+	    hwdb_array(udev, off, count, sizeof(struct hwdb_prop));
+	if (!props) {
+		return n;
+	}
+
+	for (uint32_t i = 0; i < count; ++i) {
+		char const *key = hwdb_string(udev, props[i].key);
+		char const *value = hwdb_string(udev, props[i].value);
+		if (!key || !value) {
+			continue;
+		}
+
+		unsigned k;
+		for (k = 0; k < n && strcmp(matches[k].key, key) != 0; ++k) {
+		}
+		if (k == n) {
+			if (n == max) {
+				continue;
+			}
+			++n;
+		}
+		matches[k] = (struct hwdb_match){key, value};
+	}
+
+	return n;
+}
+
+/*
+ * Walks the trie along modalias and collects the properties of all matching
+ * entries.  Strings point into the mapping, which lives as long as udev.
+ */
+static unsigned
+hwdb_lookup(struct udev const *udev, char const *modalias,
+    struct hwdb_match *matches, unsigned n, unsigned max)
+{
+	struct hwdb_header const *hdr = udev->hwdb;
+	struct hwdb_node const *nodes = hwdb_array(
+	    udev, hdr->nodes_off, hdr->node_count, sizeof(struct hwdb_node));
+	if (!nodes) {
+		return n;
+	}
+
+	struct hwdb_node const *node = &nodes[0];
+	for (char const *p = modalias;; ++p) {
+		struct hwdb_glob const *globs = hwdb_array(udev,
+		    node->globs_off, node->glob_count,
+		    sizeof(struct hwdb_glob));
+		for (uint32_t i = 0; globs && i < node->glob_count; ++i) {
+			char const *pattern =
+			    hwdb_string(udev, globs[i].pattern);
+			if (pattern && fnmatch(pattern, p, 0) == 0) {
+				n = hwdb_add_props(udev, globs[i].props_off,
+				    globs[i].prop_count, matches, n, max);
+			}
+		}
+
+		if (*p == '\0') {
+			n = hwdb_add_props(udev, node->props_off,
+			    node->prop_count, matches, n, max);
+			break;
+		}
+
+		struct hwdb_child const *children = hwdb_array(udev,
+		    node->children_off, node->child_count,
+		    sizeof(struct hwdb_child));
+		if (!children) {
+			break;
+		}
+
+		/* Children are sorted by character. */
+		uint32_t lo = 0, hi = node->child_count;
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			if (children[mid].c < (unsigned char)*p) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		if (lo == node->child_count ||
+		    children[lo].c != (unsigned char)*p ||
+		    children[lo].node >= hdr->node_count) {
+			break;
+		}
+		node = &nodes[children[lo].node];
+	}
+
+	return n;
+}
+
+static char const *
+hwdb_bus_name(uint16_t bustype)
+{
+	switch (bustype) {
+	case BUS_USB:
+		return "usb";
+	case BUS_BLUETOOTH:
+		return "bluetooth";
+	case BUS_I8042:
+		return "ps2";
+	case BUS_I2C:
+		return "i2c";
+	default:
+		return "unknown";
+	}
+}
+
+static bool
+udev_has_hwdb(struct udev *udev)
+{
+	if (!atomic_load_explicit(&udev->hwdb_checked, memory_order_acquire)) {
+		pthread_mutex_lock(&udev->lock);
+		hwdb_map(udev);
+		pthread_mutex_unlock(&udev->lock);
+	}
+
+	return udev->hwdb != NULL;
+}
+
+/* Appends the hwdb properties matching the device, using systemd's keys. */
+static int
+append_hwdb_properties(struct udev *udev, struct input_caps const *caps,
+    uint32_t input_class, struct udev_list_entry ***list_end)
+{
+	struct hwdb_match matches[64];
+	unsigned const max = sizeof(matches) / sizeof(matches[0]);
+	unsigned n = 0;
+	char modalias[320];
+
+	if (!udev_has_hwdb(udev)) {
+		return 0;
+	}
+
+	snprintf(modalias, sizeof(modalias),
+	    "evdev:input:b%04Xv%04Xp%04Xe%04X", caps->bustype, caps->vendor,
+	    caps->product, caps->version);
+	n = hwdb_lookup(udev, modalias, matches, n, max);
+
+	snprintf(modalias, sizeof(modalias),
+	    "evdev:name:%s:phys:%s:ev:%" PRIx64, caps->name, caps->phys,
+	    caps->ev[0]);
+	n = hwdb_lookup(udev, modalias, matches, n, max);
+
+	if (input_class & INPUT_CLASS_MOUSE) {
+		snprintf(modalias, sizeof(modalias),
+		    "mouse:%s:v%04xp%04x:name:%s:",
+		    hwdb_bus_name(caps->bustype), caps->vendor, caps->product,
+		    caps->name);
+		n = hwdb_lookup(udev, modalias, matches, n, max);
+	}
+
+	for (unsigned i = 0; i < n; ++i) {
+		if (append_property(list_end, matches[i].key,
+			matches[i].value) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Returns the bit of a tag, interning it if add is set, or -1. */
+static int
+tag_bit(struct udev *udev, char const *tag, bool add)
+{
+	for (unsigned i = 0; i < udev->tag_count; ++i) {
+		if (strcmp(udev->tag_names[i], tag) == 0) {
+			return (int)i;
+		}
+	}
+	if (!add || udev->tag_count == TAGS_MAX) {
+		return -1;
+	}
+
+	char *name = strdup(tag);
+	if (!name) {
+		return -1;
+	}
+	udev->tag_names[udev->tag_count] = name;
+	return (int)udev->tag_count++;
+}
+
+/* Splits off the next key=value field of a rule, unquoting the value. */
+static bool
+rule_next_field(char **line, char **key, char **value)
+{
+	char *p = *line + strspn(*line, " \t");
+	if (*p == '\0' || *p == '#') {
+		return false;
+	}
+
+	*key = p;
+	p += strcspn(p, "= \t");
+	if (*p != '=') {
+		*value = NULL;
+		*line = p + (*p != '\0');
+		*p = '\0';
+		return true;
+	}
+	*p++ = '\0';
+
+	char const *end = " \t";
+	if (*p == '"') {
+		++p;
+		end = "\"";
+	}
+	*value = p;
+	p += strcspn(p, end);
+	*line = p + (*p != '\0');
+	*p = '\0';
+	return true;
+}
+
+static int
+rule_parse(struct udev *udev, char *line, struct tag_rule *rule)
+{
+	char *key, *value;
+
+	memset(rule, 0, sizeof(*rule));
+	while (rule_next_field(&line, &key, &value)) {
+		char **pattern = NULL;
+		if (!value) {
+			return -1;
+		} else if (strcmp(key, "name") == 0) {
+			pattern = &rule->name;
+		} else if (strcmp(key, "phys") == 0) {
+			pattern = &rule->phys;
+		} else if (strcmp(key, "vendor") == 0) {
+			pattern = &rule->vendor;
+		} else if (strcmp(key, "seat") == 0) {
+			pattern = &rule->seat;
+			int bit = tag_bit(udev, "seat", true);
+			if (bit >= 0) {
+				rule->tags |= 1u << bit;
+			}
+		} else if (strcmp(key, "tag") == 0) {
+			char *save;
+			for (char *tag = strtok_r(value, ",", &save); tag;
+			     tag = strtok_r(NULL, ",", &save)) {
+				int bit = tag_bit(udev, tag, true);
+				if (bit >= 0) {
+					rule->tags |= 1u << bit;
+				}
+			}
+			continue;
+		} else {
+			return -1;
+		}
+
+		free(*pattern);
+		*pattern = strdup(value);
+		if (!*pattern) {
+			return -1;
+		}
+	}
+
+	return rule->tags ? 0 : -1;
+}
+
+static void
+rule_free(struct tag_rule *rule)
+{
+	free(rule->name);
+	free(rule->phys);
+	free(rule->vendor);
+	free(rule->seat);
+}
+
+/* Reads the tag rules once per context.  Called with udev->lock held. */
+static void
+rules_load(struct udev *udev)
+{
+	if (udev->rules_checked) {
+		return;
+	}
+	udev->rules_checked = true;
+
+	FILE *f = fopen(TAGS_PATH, "re");
+	if (!f) {
+		return;
+	}
+
+	char *line = NULL;
+	size_t line_size = 0;
+	while (getline(&line, &line_size, f) >= 0) {
+		line[strcspn(line, "\r\n")] = '\0';
+
+		struct tag_rule rule;
+		if (rule_parse(udev, line, &rule) < 0) {
+			/* Comments and empty lines end up here as well. */
+			rule_free(&rule);
+			continue;
+		}
+
+		struct tag_rule *rules = reallocarray(
+		    udev->rules, udev->rule_count + 1, sizeof(*rules));
+		if (!rules) {
+			rule_free(&rule);
+			break;
+		}
+		udev->rules = rules;
+		udev->rules[udev->rule_count++] = rule;
+	}
+
+	free(line);
+	fclose(f);
+}
+
+static void
+rules_free(struct udev *udev)
+{
+	for (unsigned i = 0; i < udev->rule_count; ++i) {
+		rule_free(&udev->rules[i]);
+	}
+	free(udev->rules);
+	for (unsigned i = 0; i < udev->tag_count; ++i) {
+		free(udev->tag_names[i]);
+	}
+}
+
+static bool
+rule_matches(struct tag_rule const *rule, struct input_caps const *caps)
+{
+	char vendor[5];
+	snprintf(vendor, sizeof(vendor), "%04x", caps->vendor);
+
+	return (!rule->name || fnmatch(rule->name, caps->name, 0) == 0) &&
+	    (!rule->phys || fnmatch(rule->phys, caps->phys, 0) == 0) &&
+	    (!rule->vendor || fnmatch(rule->vendor, vendor, 0) == 0);
+}
+
+static unsigned
+node_from_syspath(char const *syspath)
+{
+	unsigned node;
+	if (sscanf(syspath, "/dev/input/event%u", &node) != 1 || node >= 100) {
+		return 100;
+	}
+	return node;
+}
+
+static bool
+tag_index_entry_matches(
+    struct tag_index_entry const *entry, struct stat const *st)
+{
+	return entry->valid && entry->devnum == (uint64_t)st->st_rdev &&
+	    entry->ino == (uint64_t)st->st_ino &&
+	    entry->ctime_sec == (int64_t)st->st_ctim.tv_sec &&
+	    entry->ctime_nsec == (int64_t)st->st_ctim.tv_nsec;
+}
+
+/* Assigns tags and seat of a freshly probed device and records them in
+ * the tag index. */
+static void
+device_apply_rules(struct udev_device *udev_device, struct stat const *st)
+{
+	struct udev *udev = udev_device->udev;
+	if (!udev) {
+		return;
+	}
+
+	pthread_mutex_lock(&udev->lock);
+	rules_load(udev);
+	for (unsigned i = 0; i < udev->rule_count; ++i) {
+		struct tag_rule const *rule = &udev->rules[i];
+		if (rule_matches(rule, udev_device->caps)) {
+			udev_device->tags |= rule->tags;
+			if (rule->seat) {
+				udev_device->seat = rule->seat;
+			}
+		}
+	}
+
+	unsigned node = node_from_syspath(udev_device->syspath);
+	if (node < 100) {
+		udev->tag_index[node] = (struct tag_index_entry){
+		    .valid = true,
+		    .devnum = (uint64_t)st->st_rdev,
+		    .ino = (uint64_t)st->st_ino,
+		    .ctime_sec = (int64_t)st->st_ctim.tv_sec,
+		    .ctime_nsec = (int64_t)st->st_ctim.tv_nsec,
+		    .tags = udev_device->tags,
+		    .seat = udev_device->seat,
+		};
+	}
+	pthread_mutex_unlock(&udev->lock);
+}
+
+/*
+ * Looks up the tags of a node in the index.  Nodes not in it, or changed
+ * since, are probed, which takes their data from the snapshot where
+ * possible.  Returns -1 if the node is gone or cannot be probed.
+ */
+static int
+tag_index_lookup(
+    struct udev *udev, unsigned node, uint32_t *tags, char const **seat)
+{
+	char path[32];
+	struct stat st;
+	snprintf(path, sizeof(path), "/dev/input/event%u", node);
+	if (stat(path, &st) != 0) {
+		return -1;
+	}
+
+	/* Live enumeration reports nodes past the indexed range; those are
+	 * always evaluated. */
+	if (node < 100) {
+		pthread_mutex_lock(&udev->lock);
+		struct tag_index_entry const *entry = &udev->tag_index[node];
+		bool hit = tag_index_entry_matches(entry, &st);
+		if (hit) {
+			*tags = entry->tags;
+			*seat = entry->seat;
+		}
+		pthread_mutex_unlock(&udev->lock);
+		if (hit) {
+			return 0;
+		}
+	}
+
+	struct udev_device *udev_device =
+	    udev_device_new_from_syspath(udev, path);
+	if (!udev_device) {
+		return -1;
+	}
+	int ret = device_probe(udev_device);
+	*tags = udev_device->tags;
+	*seat = udev_device->seat;
+	udev_device_unref(udev_device);
+	return ret;
+}
+
+/* Called with udev->lock held. */
+static void
+fd_cache_unlink(struct udev *udev, struct udev_device *udev_device)
+{
+	struct udev_device **p = &udev->fd_cache;
+	while (*p != udev_device) {
+		p = &(*p)->next_fd;
+	}
+	*p = udev_device->next_fd;
+	udev_device->next_fd = NULL;
+	udev_device->fd_cached = false;
+	--udev->fd_cache_count;
+}
+
+/* Called with udev->lock held. */
+static void
+fd_cache_expire(struct udev *udev)
+{
+	uint64_t now = now_usec();
+	struct udev_device **p = &udev->fd_cache;
+	while (*p) {
+		struct udev_device *dev = *p;
+		if (now - dev->fd_usec < udev->fd_idle_usec) {
+			p = &dev->next_fd;
+			continue;
+		}
+		*p = dev->next_fd;
+		dev->next_fd = NULL;
+		dev->fd_cached = false;
+		--udev->fd_cache_count;
+		close(dev->fd);
+	}
+}
+
+/* Closes the oldest descriptors until at most limit are left.  Called
+ * with udev->lock held. */
+static void
+fd_cache_trim(struct udev *udev, unsigned limit)
+{
+	while (udev->fd_cache_count > limit) {
+		struct udev_device *oldest = udev->fd_cache;
+		while (oldest->next_fd) {
+			oldest = oldest->next_fd;
+		}
+		fd_cache_unlink(udev, oldest);
+		close(oldest->fd);
+	}
+}
+
+static void
+fd_cache_add(struct udev *udev, struct udev_device *udev_device, int fd)
+{
+	pthread_mutex_lock(&udev->lock);
+	if (udev->fd_cache_max == 0) {
+		pthread_mutex_unlock(&udev->lock);
+		close(fd);
+		return;
+	}
+	fd_cache_expire(udev);
+	fd_cache_trim(udev, udev->fd_cache_max - 1);
+
+	udev_device->fd = fd;
+	udev_device->fd_usec = now_usec();
+	udev_device->fd_cached = true;
+	udev_device->next_fd = udev->fd_cache;
+	udev->fd_cache = udev_device;
+	++udev->fd_cache_count;
+	pthread_mutex_unlock(&udev->lock);
+}
+
+/* Fills in the capabilities and the classification of a device. */
+static int
+probe_device(struct udev_device *udev_device, struct stat const *st)
+{
+	uint32_t input_class;
+	struct udev *udev = udev_device->udev;
+	bool keep_fd = false;
+	int found = -1;
+
+	struct input_caps *caps = malloc(sizeof(struct input_caps));
+	if (!caps) {
+		return -1;
+	}
+
+	if (udev) {
+		pthread_mutex_lock(&udev->lock);
+		found = snapshot_lookup(udev, st, &input_class, caps);
+		/* udev_enable_fd_handoff() may run concurrently. */
+		keep_fd = udev->fd_cache_max > 0;
+		pthread_mutex_unlock(&udev->lock);
+	}
+
+	if (found != 0) {
+		int fd = -1;
+		if (probe_input_caps(udev_device->syspath, caps,
+			keep_fd ? &fd : NULL) != 0) {
+			int err = errno;
+			free(caps);
+			errno = err;
+			return -1;
+		}
+		if (fd >= 0) {
+			fd_cache_add(udev, udev_device, fd);
+		}
+		input_class = classify_input_caps(caps);
+		if (udev) {
+			pthread_mutex_lock(&udev->lock);
+			snapshot_store(udev, st, input_class, caps);
+			pthread_mutex_unlock(&udev->lock);
+		}
+	}
+
+	udev_device->caps = caps;
+	udev_device->input_class = input_class;
+	device_apply_rules(udev_device, st);
+
+	return 0;
+}
+
+/*
+ * Callers that lose the race to probe a device sleep on this until the
+ * winner is done.  Contention is rare, so one pair serves all devices,
+ * including those without a context.
+ */
+static pthread_mutex_t probe_wait_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t probe_wait_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Probes the device once, on the first call that needs its capabilities.
+ * Concurrent callers block until the winner's open and ioctls are done.
+ */
+static int
+device_probe(struct udev_device *udev_device)
+{
+	int state = atomic_load_explicit(
+	    &udev_device->probe_state, memory_order_acquire);
+
+	if (state != PROBE_DONE) {
+		state = PROBE_NONE;
+		if (atomic_compare_exchange_strong_explicit(
+			&udev_device->probe_state, &state, PROBE_RUNNING,
+			memory_order_acquire, memory_order_acquire)) {
+			struct stat st;
+			if (stat(udev_device->syspath, &st) != 0 ||
+			    probe_device(udev_device, &st) < 0) {
+				udev_device->probe_error = errno;
+			}
+			/* devd announces nodes before their permissions are
+			 * set; report those as not yet initialized. */
+			udev_device->uninitialized =
+			    udev_device->probe_error == EACCES ||
+			    udev_device->probe_error == EPERM;
+			pthread_mutex_lock(&probe_wait_lock);
+			atomic_store_explicit(&udev_device->probe_state,
+			    PROBE_DONE, memory_order_release);
+			pthread_cond_broadcast(&probe_wait_cond);
+			pthread_mutex_unlock(&probe_wait_lock);
+		} else {
+			pthread_mutex_lock(&probe_wait_lock);
+			while (atomic_load_explicit(&udev_device->probe_state,
+				   memory_order_acquire) != PROBE_DONE) {
+				pthread_cond_wait(
+				    &probe_wait_cond, &probe_wait_lock);
+			}
+			pthread_mutex_unlock(&probe_wait_lock);
+		}
+	}
+
+	if (udev_device->probe_error != 0) {
+		errno = udev_device->probe_error;
+		return -1;
+	}
+	return 0;
+}
+
+static uint32_t const *
+buffer_offsets(struct device_buffer const *buffer)
+{
+	return (uint32_t const *)(buffer + 1);
+}
+
+static char const *
+buffer_property_value(
+    struct device_buffer const *buffer, char const *property)
+{
+	uint32_t const *offsets = buffer_offsets(buffer);
+	char const *base = (char const *)buffer;
+
+	for (uint32_t i = 0; i < buffer->prop_count; ++i) {
+		if (strcmp(base + offsets[2 * i], property) == 0) {
+			return base + offsets[2 * i + 1];
+		}
+	}
+	return NULL;
+}
+
+/* A single allocation of entries pointing into the record; freed with
+ * free() rather than free_dev_list(). */
+static struct udev_list_entry *
+buffer_properties_list(struct device_buffer const *buffer)
+{
+	uint32_t const *offsets = buffer_offsets(buffer);
+	char const *base = (char const *)buffer;
+	uint32_t count = buffer->prop_count;
+
+	if (count == 0) {
+		return NULL;
+	}
+
+	struct udev_list_entry *list = calloc(count, sizeof(*list));
+	if (!list) {
+		return NULL;
+	}
+	for (uint32_t i = 0; i < count; ++i) {
+		list[i].name = base + offsets[2 * i];
+		list[i].value = base + offsets[2 * i + 1];
+		list[i].next = i + 1 < count ? &list[i + 1] : NULL;
+	}
+	return list;
+}
+
+/* Appends TAGS in the ":tag1:tag2:" form udev uses. */
+static int
+append_tags_property(
+    struct udev_device *udev_device, struct udev_list_entry ***list_end)
+{
+	struct udev *udev = udev_device->udev;
+	char tags[1024] = ":";
+	size_t len = 1;
+
+	pthread_mutex_lock(&udev->lock);
+	for (unsigned i = 0; i < udev->tag_count; ++i) {
+		if (udev_device->tags & (1u << i)) {
+			int n = snprintf(tags + len, sizeof(tags) - len, "%s:",
+			    udev->tag_names[i]);
+			if (n < 0 || (size_t)n >= sizeof(tags) - len) {
+				break;
+			}
+			len += (size_t)n;
+		}
+	}
+	pthread_mutex_unlock(&udev->lock);
+
+	return append_property(list_end, "TAGS", tags);
+}
+
+/* Materializes the ID_INPUT_* flags, hwdb properties, tags and seat of a
+ * probed device. */
+static struct udev_list_entry *
+build_properties_list(struct udev_device *udev_device)
+{
+	struct udev_list_entry *list = NULL;
+	struct udev_list_entry **list_end = &list;
+
+	if (udev_device->buffer) {
+		return buffer_properties_list(udev_device->buffer);
+	}
+
+	for (unsigned i = 0; i < INPUT_CLASS_COUNT; ++i) {
+		if (!(udev_device->input_class & (1u << i))) {
+			continue;
+		}
+
+		if (append_property(&list_end, input_class_names[i], "1") <
+		    0) {
+			free_dev_list(&list);
+			return NULL;
+		}
+	}
+
+	if (udev_device->udev &&
+	    append_hwdb_properties(udev_device->udev, udev_device->caps,
+		udev_device->input_class, &list_end) < 0) {
+		free_dev_list(&list);
+		return NULL;
+	}
+
+	if (udev_device->tags &&
+	    append_tags_property(udev_device, &list_end) < 0) {
+		free_dev_list(&list);
+		return NULL;
+	}
+
+	if (udev_device->seat &&
+	    append_property(&list_end, "ID_SEAT", udev_device->seat) < 0) {
+		free_dev_list(&list);
+		return NULL;
+	}
+
+	return list;
+}
+
+static struct udev_list_entry *
+device_properties(struct udev_device *udev_device)
+{
+	struct udev_list_entry *list = atomic_load_explicit(
+	    &udev_device->properties_list, memory_order_acquire);
+	if (list || udev_device->is_parent || device_probe(udev_device) < 0) {
+		return list;
+	}
+
+	list = build_properties_list(udev_device);
+	if (!list) {
+		return NULL;
+	}
+
+	struct udev_list_entry *expected = NULL;
+	if (!atomic_compare_exchange_strong_explicit(
+		&udev_device->properties_list, &expected, list,
+		memory_order_acq_rel, memory_order_acquire)) {
+		free_dev_list(&list);
+		list = expected;
+	}
+	return list;
+}
+
+static struct udev_device *
+udev_device_new_from_syspath_impl(
+    struct udev *udev, const char *syspath, bool do_open)
+{
+	LOG("udev_device_new_from_syspath %s\n", syspath);
+	struct udev_device *u = calloc(1, sizeof(struct udev_device));
+	if (u) {
+		struct stat st;
+		if (do_open) {
+			if (stat(syspath, &st) == 0) {
+				u->devnum = st.st_rdev;
+			} else {
+				free(u);
+				return NULL;
+			}
+		}
+
+		u->udev = context_ref(udev);
+		atomic_init(&u->refcount, 1);
+		snprintf(u->syspath, sizeof(u->syspath), "%s", syspath);
+		u->sysname = (char const *)u->syspath + 11;
+		u->subsystem = "input";
+
+		/* Opening the node is deferred to device_probe(); devices
+		 * that are never probed cost a single stat. */
+		if (!do_open) {
+			u->probe_error = ENODEV;
+			atomic_init(&u->probe_state, PROBE_DONE);
+		}
+
+		return u;
+	}
+	return NULL;
+}
+
+struct udev_device *
+udev_device_new_from_syspath(struct udev *udev, const char *syspath)
+{
+	return udev_device_new_from_syspath_impl(udev, syspath, true);
+}
+
+const char *
+udev_device_get_syspath(struct udev_device *udev_device)
+{
+	LOG("udev_device_get_syspath\n");
+	return udev_device->syspath;
+}
+
+const char *
+udev_device_get_sysname(struct udev_device *udev_device)
+{
+	LOG("udev_device_get_sysname\n");
+	return udev_device->sysname;
+}
+
+const char *
+udev_device_get_subsystem(struct udev_device *udev_device)
+{
+	LOG("udev_device_get_subsystem\n");
+	return udev_device->subsystem;
+}
+
+const char *
+udev_device_get_devtype(struct udev_device *udev_device)
+{
+	LOG("udev_device_get_devtype\n");
+	return udev_device->devtype;
+}
+
+/* Formats a bitmap like the kernel does: hex longs, most significant
+ * first, without leading zero words. */
+static char *
+format_caps_bitmap(uint64_t const *bits, unsigned max)
+{
+	unsigned const per_word = (unsigned)(64 / (sizeof(unsigned long) * 8));
+	unsigned const nwords = CAPS_WORDS(max) * per_word;
+	unsigned const word_bits = (unsigned)sizeof(unsigned long) * 8;
+
+	char *str = malloc(nwords * (sizeof(unsigned long) * 2 + 1) + 1);
+	if (!str) {
+		return NULL;
+	}
+
+	char *p = str;
+	bool leading = true;
+	for (unsigned i = nwords; i-- > 0;) {
+		unsigned long word = (unsigned long)(bits[i / per_word] >>
+		    (i % per_word * word_bits));
+		if (leading && word == 0 && i > 0) {
+			continue;
+		}
+		p += sprintf(p, leading ? "%lx" : " %lx", word);
+		leading = false;
+	}
+
+	return str;
+}
+
+static char *
+format_sysattr(struct input_caps const *caps, unsigned idx)
+{
+	if (idx < ID_SYSATTRS_COUNT) {
+		uint16_t const ids[] = {
+		    caps->bustype, caps->vendor, caps->product, caps->version};
+		char *str = malloc(5);
+		if (str) {
+			snprintf(str, 5, "%04x", ids[idx]);
+		}
+		return str;
+	}
+
+	idx -= ID_SYSATTRS_COUNT;
+	return format_caps_bitmap(
+	    caps_bitmap(caps, idx), caps_bitmaps[idx].max);
+}
+
+const char *
+udev_device_get_sysattr_value(
+    struct udev_device *udev_device, const char *sysattr)
+{
+	LOG("udev_device_get_sysattr_value %s\n", sysattr);
+
+	if (!sysattr ||
+	    (!udev_device->is_parent && device_probe(udev_device) < 0)) {
+		return NULL;
+	}
+
+	struct input_caps const *caps = udev_device->caps;
+
+	if (strcmp(sysattr, "name") == 0) {
+		return caps->name;
+	} else if (strcmp(sysattr, "phys") == 0) {
+		return caps->phys;
+	} else if (strcmp(sysattr, "uniq") == 0) {
+		return caps->uniq;
+	}
+
+	if (udev_device->is_parent && udev_device->devtype &&
+	    strcmp(udev_device->devtype, "usb_device") == 0) {
+		if (strcmp(sysattr, "idVendor") == 0) {
+			sysattr = "id/vendor";
+		} else if (strcmp(sysattr, "idProduct") == 0) {
+			sysattr = "id/product";
+		} else if (strcmp(sysattr, "product") == 0) {
+			return caps->name;
+		} else {
+			return NULL;
+		}
+	}
+
+	unsigned idx;
+	for (idx = 0; idx < CACHED_SYSATTRS_COUNT; ++idx) {
+		char const *name = idx < ID_SYSATTRS_COUNT
+		    ? id_sysattrs[idx]
+		    : caps_bitmaps[idx - ID_SYSATTRS_COUNT].sysattr;
+		if (strcmp(sysattr, name) == 0) {
+			break;
+		}
+	}
+	if (idx == CACHED_SYSATTRS_COUNT ||
+	    (idx >= ID_SYSATTRS_COUNT && udev_device->is_parent)) {
+		return NULL;
+	}
+
+	char *value = atomic_load_explicit(
+	    &udev_device->sysattrs[idx], memory_order_acquire);
+	if (value) {
+		return value;
+	}
+
+	value = format_sysattr(caps, idx);
+	if (!value) {
+		return NULL;
+	}
+
+	char *expected = NULL;
+	if (!atomic_compare_exchange_strong_explicit(
+		&udev_device->sysattrs[idx], &expected, value,
+		memory_order_acq_rel, memory_order_acquire)) {
+		free(value);
+		return expected;
+	}
+	return value;
+}
+
+struct udev_list_entry *
+udev_device_get_properties_list_entry(struct udev_device *udev_device)
+{
+	LOG("udev_device_get_properties_list_entry\n");
+	return device_properties(udev_device);
+}
+
+struct udev_device *
+udev_device_ref(struct udev_device *udev_device)
+{
+	LOG("udev_device_ref\n");
+	refcount_inc(&udev_device->refcount);
+	return udev_device;
+}
+
+static void
+udev_device_free(struct udev_device *udev_device)
+{
+	struct udev_device *parent =
+	    atomic_load_explicit(&udev_device->parent, memory_order_relaxed);
+	if (parent) {
+		udev_device_unref(parent);
+	}
+	for (unsigned i = 0; i < CACHED_SYSATTRS_COUNT; ++i) {
+		free(atomic_load_explicit(
+		    &udev_device->sysattrs[i], memory_order_relaxed));
+	}
+	/* Only probed event devices can have a descriptor in the cache.
+	 * Parents are skipped: parent_get() frees a half-built one with
+	 * udev->lock held. */
+	if (udev_device->caps && udev_device->udev &&
+	    !udev_device->is_parent && !udev_device->buffer) {
+		pthread_mutex_lock(&udev_device->udev->lock);
+		if (udev_device->fd_cached) {
+			fd_cache_unlink(udev_device->udev, udev_device);
+			close(udev_device->fd);
+		}
+		pthread_mutex_unlock(&udev_device->udev->lock);
+	}
+	struct udev_list_entry *list = atomic_load_explicit(
+	    &udev_device->properties_list, memory_order_relaxed);
+	if (udev_device->buffer) {
+		free(list);
+	} else {
+		free(udev_device->caps);
+		free_dev_list(&list);
+	}
+	context_unref(udev_device->udev);
+	free(udev_device);
+}
+
+void
+udev_device_unref(struct udev_device *udev_device)
+{
+	LOG("udev_device_unref %p %d\n", (void *)udev_device,
+	    udev_device->refcount);
+
+	if (!udev_device->interned) {
+		if (refcount_dec(&udev_device->refcount)) {
+			udev_device_free(udev_device);
+		}
+		return;
+	}
+
+	/* Interned parents drop their last reference under the lock, so a
+	 * concurrent lookup never revives a dying parent. */
+	struct udev *udev = udev_device->udev;
+	pthread_mutex_lock(&udev->lock);
+	bool last = refcount_dec(&udev_device->refcount);
+	if (last) {
+		struct udev_device **p = &udev->parents;
+		while (*p != udev_device) {
+			p = &(*p)->next_interned;
+		}
+		*p = udev_device->next_interned;
+	}
+	pthread_mutex_unlock(&udev->lock);
+
+	if (last) {
+		udev_device_free(udev_device);
+	}
+}
+
+static int
+append_property(
+    struct udev_list_entry ***end, char const *name, char const *value)
+{
+	struct udev_list_entry *le = create_list_entry_name_value(name, value);
+	if (!le) {
+		return -1;
+	}
+	**end = le;
+	*end = &le->next;
+	return 0;
+}
+
+/*
+ * Creates a parent carrying the identity part of caps.  Input parents
+ * stand for the physical device behind one or more event nodes, USB
+ * parents for the USB device behind those.
+ */
+static struct udev_device *
+parent_new(struct udev *udev, char const *subsystem, char const *devtype,
+    struct input_caps const *caps, struct udev_device *grandparent)
+{
+	struct udev_device *parent = calloc(1, sizeof(struct udev_device));
+	if (!parent) {
+		return NULL;
+	}
+
+	parent->caps = malloc(sizeof(struct input_caps));
+	if (!parent->caps) {
+		free(parent);
+		return NULL;
+	}
+	*parent->caps = *caps;
+
+	parent->udev = context_ref(udev);
+	atomic_init(&parent->refcount, 1);
+	parent->sysname = parent->syspath;
+	parent->subsystem = subsystem;
+	parent->devtype = devtype;
+	parent->is_parent = true;
+	atomic_init(&parent->probe_state, PROBE_DONE);
+
+	char buf[32];
+	struct udev_list_entry *list = NULL;
+	struct udev_list_entry **end = &list;
+	int err = 0;
+
+	if (strcmp(subsystem, "usb") == 0) {
+		snprintf(buf, sizeof(buf), "%04x", caps->vendor);
+		err |= append_property(&end, "ID_VENDOR_ID", buf);
+		snprintf(buf, sizeof(buf), "%04x", caps->product);
+		err |= append_property(&end, "ID_MODEL_ID", buf);
+		err |= append_property(&end, "ID_BUS", "usb");
+	} else {
+		err |= append_property(&end, "NAME", caps->name);
+		err |= append_property(&end, "PHYS", caps->phys);
+		if (caps->uniq[0] != '\0') {
+			err |= append_property(&end, "UNIQ", caps->uniq);
+		}
+		snprintf(buf, sizeof(buf), "%x/%x/%x/%x", caps->bustype,
+		    caps->vendor, caps->product, caps->version);
+		err |= append_property(&end, "PRODUCT", buf);
+	}
+
+	atomic_init(&parent->properties_list, list);
+	if (err) {
+		udev_device_free(parent);
+		return NULL;
+	}
+
+	atomic_init(&parent->parent, grandparent);
+	return parent;
+}
+
+static bool
+parent_matches(struct udev_device const *parent, char const *subsystem,
+    struct input_caps const *caps)
+{
+	struct input_caps const *own = parent->caps;
+	return strcmp(parent->subsystem, subsystem) == 0 &&
+	    strcmp(own->phys, caps->phys) == 0 &&
+	    own->bustype == caps->bustype && own->vendor == caps->vendor &&
+	    own->product == caps->product && own->version == caps->version;
+}
+
+/*
+ * Returns a new reference to the parent matching caps, creating it if
+ * needed.  Takes over the reference to grandparent.
+ */
+static struct udev_device *
+parent_get(struct udev *udev, char const *subsystem, char const *devtype,
+    struct input_caps const *caps, struct udev_device *grandparent)
+{
+	/* Without a physical path there is nothing to share. */
+	if (!udev || caps->phys[0] == '\0') {
+		struct udev_device *parent =
+		    parent_new(udev, subsystem, devtype, caps, grandparent);
+		if (!parent && grandparent) {
+			udev_device_unref(grandparent);
+		}
+		return parent;
+	}
+
+	pthread_mutex_lock(&udev->lock);
+
+	struct udev_device *parent;
+	for (parent = udev->parents; parent; parent = parent->next_interned) {
+		if (parent_matches(parent, subsystem, caps)) {
+			refcount_inc(&parent->refcount);
+			break;
+		}
+	}
+
+	if (!parent) {
+		parent =
+		    parent_new(udev, subsystem, devtype, caps, grandparent);
+		if (parent) {
+			grandparent = NULL;
+			parent->interned = true;
+			parent->next_interned = udev->parents;
+			udev->parents = parent;
+		}
+	}
+
+	pthread_mutex_unlock(&udev->lock);
+
+	if (grandparent) {
+		udev_device_unref(grandparent);
+	}
+	return parent;
+}
+
+static struct udev_device *
+input_parent_get(struct udev *udev, struct input_caps const *caps)
+{
+	struct udev_device *usb = NULL;
+
+	if (caps->bustype == BUS_USB) {
+		/* The USB device is identified by the part of phys before
+		 * the interface, e.g. "usb-0000:00:14.0-1" in
+		 * "usb-0000:00:14.0-1/input0". */
+		struct input_caps usb_caps;
+		memset(&usb_caps, 0, sizeof(usb_caps));
+		usb_caps.bustype = caps->bustype;
+		usb_caps.vendor = caps->vendor;
+		usb_caps.product = caps->product;
+		snprintf(usb_caps.name, sizeof(usb_caps.name), "%s",
+		    caps->name);
+		snprintf(usb_caps.phys, sizeof(usb_caps.phys), "%.*s",
+		    (int)strcspn(caps->phys, "/"), caps->phys);
+		usb = parent_get(udev, "usb", "usb_device", &usb_caps, NULL);
+	}
+
+	struct input_caps parent_caps = *caps;
+	memset((char *)&parent_caps + offsetof(struct input_caps, ev), 0,
+	    sizeof(parent_caps) - offsetof(struct input_caps, ev));
+
+	return parent_get(udev, "input", NULL, &parent_caps, usb);
+}
+
+struct udev_device *
+udev_device_get_parent(struct udev_device *udev_device)
+{
+	LOG("udev_device_get_parent %p %d\n", (void *)udev_device,
+	    udev_device->refcount);
+
+	struct udev_device *parent =
+	    atomic_load_explicit(&udev_device->parent, memory_order_acquire);
+	if (parent || udev_device->is_parent) {
+		return parent;
+	}
+
+	if (device_probe(udev_device) < 0) {
+		return NULL;
+	}
+
+	parent = input_parent_get(udev_device->udev, udev_device->caps);
+	if (!parent) {
+		return NULL;
+	}
+
+	/* Another thread may have published a parent in the meantime. */
+	struct udev_device *expected = NULL;
+	if (!atomic_compare_exchange_strong_explicit(&udev_device->parent,
+		&expected, parent, memory_order_acq_rel,
+		memory_order_acquire)) {
+		udev_device_unref(parent);
+		return expected;
+	}
+	return parent;
+}
+
+int
+udev_device_get_is_initialized(struct udev_device *udev_device)
+{
+	LOG("udev_device_get_is_initialized %p %d\n", (void *)udev_device,
+	    udev_device->refcount);
+	if (!udev_device->is_parent) {
+		device_probe(udev_device);
+	}
+	return !udev_device->uninitialized;
+}
+
+int
+udev_device_take_fd(struct udev_device *udev_device)
+{
+	LOG("udev_device_take_fd %s\n", udev_device->syspath);
+
+	struct udev *udev = udev_device->udev;
+	int fd = -1;
+
+	if (udev && device_probe(udev_device) == 0) {
+		pthread_mutex_lock(&udev->lock);
+		fd_cache_expire(udev);
+		if (udev_device->fd_cached) {
+			fd_cache_unlink(udev, udev_device);
+			fd = udev_device->fd;
+		}
+		pthread_mutex_unlock(&udev->lock);
+	}
+
+	if (fd < 0) {
+		errno = ENOENT;
+	}
+	return fd;
+}
+
+unsigned long long
+udev_device_get_seqnum(struct udev_device *udev_device)
+{
+	LOG("udev_device_get_seqnum\n");
+	return udev_device->seqnum;
+}
+
+/* For monitor events, the time since devd reported the node.  Devices
+ * not delivered by a monitor have no such time and return 0. */
+unsigned long long
+udev_device_get_usec_since_initialized(struct udev_device *udev_device)
+{
+	LOG("udev_device_get_usec_since_initialized\n");
+	if (udev_device->usec_initialized == 0) {
+		return 0;
+	}
+	return now_usec() - udev_device->usec_initialized;
+}
+
+int
+udev_device_has_tag(struct udev_device *udev_device, char const *tag)
+{
+	LOG("udev_device_has_tag %s\n", tag);
+
+	if (!tag || *tag == '\0' || udev_device->is_parent) {
+		return 0;
+	}
+
+	/* Records carry their tags as the TAGS property only. */
+	if (udev_device->buffer) {
+		char const *tags =
+		    buffer_property_value(udev_device->buffer, "TAGS");
+		size_t len = strlen(tag);
+		for (char const *p = tags; p && (p = strstr(p, tag)); ++p) {
+			if (p > tags && p[-1] == ':' && p[len] == ':') {
+				return 1;
+			}
+		}
+		return 0;
+	}
+
+	/* Removed devices are not probed, their tags come from the index. */
+	(void)device_probe(udev_device);
+
+	struct udev *udev = udev_device->udev;
+	if (!udev || !udev_device->tags) {
+		return 0;
+	}
+	pthread_mutex_lock(&udev->lock);
+	int bit = tag_bit(udev, tag, false);
+	pthread_mutex_unlock(&udev->lock);
+	return bit >= 0 && (udev_device->tags & (1u << bit)) ? 1 : 0;
+}
+
+const char *
+udev_device_get_action(struct udev_device *udev_device)
+{
+	LOG("stub: udev_device_get_action\n");
+	return udev_device->action;
+}
+
+struct udev_device *
+udev_device_get_parent_with_subsystem_devtype(struct udev_device *udev_device,
+    char const *subsystem, char const *devtype)
+{
+	LOG("udev_device_get_parent_with_subsystem_devtype %s %s\n",
+	    subsystem, devtype);
+
+	if (!subsystem) {
+		return NULL;
+	}
+
+	struct udev_device *parent = udev_device_get_parent(udev_device);
+	for (; parent; parent = udev_device_get_parent(parent)) {
+		if (strcmp(parent->subsystem, subsystem) != 0) {
+			continue;
+		}
+		if (!devtype || (parent->devtype &&
+				    strcmp(parent->devtype, devtype) == 0)) {
+			return parent;
+		}
+	}
+
+	return NULL;
+}
+
+ssize_t
+udev_device_serialize(struct udev_device *udev_device, void *buf, size_t size)
+{
+	LOG("udev_device_serialize %s\n", udev_device->syspath);
+
+	if (udev_device->is_parent) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (device_probe(udev_device) < 0) {
+		return -1;
+	}
+
+	struct udev_list_entry *props = device_properties(udev_device);
+	struct udev_list_entry *entry;
+	uint32_t count = 0;
+	size_t strings_size = 0;
+
+	udev_list_entry_foreach(entry, props)
+	{
+		++count;
+		strings_size += strlen(entry->name) + 1 +
+		    (entry->value ? strlen(entry->value) : 0) + 1;
+	}
+
+	size_t total = sizeof(struct device_buffer) +
+	    2 * count * sizeof(uint32_t) + strings_size;
+	total = (total + 7) & ~(size_t)7;
+	if (total > UINT32_MAX) {
+		errno = E2BIG;
+		return -1;
+	}
+	if (size < total) {
+		return (ssize_t)total;
+	}
+
+	struct device_buffer hdr = {
+	    .magic = DEVICE_BUFFER_MAGIC,
+	    .version = DEVICE_BUFFER_VERSION,
+	    .size = (uint32_t)total,
+	    .prop_count = count,
+	    .devnum = (uint64_t)udev_device->devnum,
+	    .input_class = udev_device->input_class,
+	    .caps = *udev_device->caps,
+	};
+	memcpy(hdr.syspath, udev_device->syspath, sizeof(hdr.syspath));
+
+	/* buf need not be aligned, everything is copied in bytewise. */
+	char *out = buf;
+	memset(out, 0, total);
+	memcpy(out, &hdr, sizeof(hdr));
+
+	size_t off_pos = sizeof(hdr);
+	size_t str_pos = off_pos + 2 * count * sizeof(uint32_t);
+	udev_list_entry_foreach(entry, props)
+	{
+		char const *strs[2] = {
+		    entry->name, entry->value ? entry->value : ""};
+		for (unsigned k = 0; k < 2; ++k) {
+			uint32_t off = (uint32_t)str_pos;
+			size_t len = strlen(strs[k]) + 1;
+			memcpy(out + off_pos, &off, sizeof(off));
+			memcpy(out + str_pos, strs[k], len);
+			off_pos += sizeof(off);
+			str_pos += len;
+		}
+	}
+
+	return (ssize_t)total;
+}
+
+struct udev_device *
+udev_device_new_from_buffer(
+    struct udev *udev, void const *buf, size_t size, size_t *used)
+{
+	LOG("udev_device_new_from_buffer\n");
+
+	struct device_buffer const *hdr = buf;
+	char const *base = buf;
+
+	/* Checks that keep every access in bounds; the property strings
+	 * are not scanned.  An offset below size always hits a NUL, since
+	 * the record ends in one.  The fixed-size strings must hold one of
+	 * their own. */
+	if ((uintptr_t)buf % 8 != 0 || size < sizeof(*hdr) ||
+	    hdr->magic != DEVICE_BUFFER_MAGIC ||
+	    hdr->version != DEVICE_BUFFER_VERSION || hdr->size > size ||
+	    hdr->size < sizeof(*hdr) || hdr->size % 8 != 0 ||
+	    base[hdr->size - 1] != '\0' ||
+	    hdr->prop_count > (hdr->size - sizeof(*hdr)) / 8 ||
+	    !memchr(hdr->syspath, '\0', sizeof(hdr->syspath)) ||
+	    !memchr(hdr->caps.name, '\0', sizeof(hdr->caps.name)) ||
+	    !memchr(hdr->caps.phys, '\0', sizeof(hdr->caps.phys)) ||
+	    !memchr(hdr->caps.uniq, '\0', sizeof(hdr->caps.uniq))) {
+		errno = EINVAL;
+		return NULL;
+	}
+	uint32_t const *offsets = buffer_offsets(hdr);
+	for (uint32_t i = 0; i < 2 * hdr->prop_count; ++i) {
+		if (offsets[i] >= hdr->size) {
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+
+	struct udev_device *u = calloc(1, sizeof(struct udev_device));
+	if (!u) {
+		return NULL;
+	}
+
+	u->udev = context_ref(udev);
+	atomic_init(&u->refcount, 1);
+	memcpy(u->syspath, hdr->syspath, sizeof(u->syspath));
+	char const *slash = strrchr(u->syspath, '/');
+	u->sysname = slash ? slash + 1 : u->syspath;
+	u->subsystem = "input";
+	u->devnum = (dev_t)hdr->devnum;
+	u->input_class = hdr->input_class;
+	u->caps = (struct input_caps *)&hdr->caps;
+	u->buffer = hdr;
+	/* Everything a probe would find is in the record. */
+	atomic_init(&u->probe_state, PROBE_DONE);
+
+	if (used) {
+		*used = hdr->size;
+	}
+	return u;
+}
+
+struct udev_enumerate *
+udev_enumerate_new(struct udev *udev)
+{
+	LOG("udev_enumerate_new\n");
+	struct udev_enumerate *u = calloc(1, sizeof(struct udev_enumerate));
+	if (u) {
+		u->udev = context_ref(udev);
+		atomic_init(&u->refcount, 1);
+		return u;
+	}
+	return NULL;
+}
+
+int
+udev_enumerate_add_match_subsystem(
+    struct udev_enumerate *udev_enumerate, const char *subsystem)
+{
+	LOG("udev_enumerate_add_match_subsystem\n");
+	if (strcmp(subsystem, "input") != 0) {
+		return -1;
+	}
+
+	udev_enumerate->scan_for_input = 1;
+	return 0;
+}
+
+/* Orders sysnames like "event2" before "event10". */
+static int
+sysname_cmp(char const *a, char const *b)
+{
+	while (*a && *b) {
+		if (isdigit((unsigned char)*a) && isdigit((unsigned char)*b)) {
+			while (*a == '0') {
+				++a;
+			}
+			while (*b == '0') {
+				++b;
+			}
+			size_t na = strspn(a, "0123456789");
+			size_t nb = strspn(b, "0123456789");
+			if (na != nb) {
+				return na < nb ? -1 : 1;
+			}
+			int c = strncmp(a, b, na);
+			if (c != 0) {
+				return c;
+			}
+			a += na;
+			b += nb;
+			continue;
+		}
+		if (*a != *b) {
+			return (unsigned char)*a < (unsigned char)*b ? -1 : 1;
+		}
+		++a;
+		++b;
+	}
+	return (unsigned char)*a - (unsigned char)*b;
+}
+
+static char const *
+entry_sysname(struct udev_list_entry const *entry)
+{
+	return strrchr(entry->name, '/') + 1;
+}
+
+static int
+compare_nodes(void const *a, void const *b)
+{
+	unsigned x = *(unsigned const *)a;
+	unsigned y = *(unsigned const *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Drops the nodes that fail the tag and seat filters.  Nodes in the tag
+ * index cost a stat, nothing is opened for them. */
+static size_t
+filter_dev_nodes(
+    struct udev_enumerate *udev_enumerate, unsigned *nodes, size_t count)
+{
+	if (udev_enumerate->no_match) {
+		return 0;
+	}
+	if (!udev_enumerate->match_tags && !udev_enumerate->match_seat) {
+		return count;
+	}
+
+	size_t kept = 0;
+	for (size_t i = 0; i < count; ++i) {
+		uint32_t tags;
+		char const *seat;
+		if (tag_index_lookup(
+			udev_enumerate->udev, nodes[i], &tags, &seat) < 0) {
+			continue;
+		}
+		if ((tags & udev_enumerate->match_tags) !=
+		    udev_enumerate->match_tags) {
+			continue;
+		}
+		if (udev_enumerate->match_seat &&
+		    strcmp(udev_enumerate->match_seat,
+			seat ? seat : "seat0") != 0) {
+			continue;
+		}
+		nodes[kept++] = nodes[i];
+	}
+	return kept;
+}
+
+/* Replaces the scan results by the given event nodes. */
+static int
+set_dev_nodes(
+    struct udev_enumerate *udev_enumerate, unsigned *nodes, size_t count)
+{
+	count = filter_dev_nodes(udev_enumerate, nodes, count);
+
+	/* eventN sorts by N, see sysname_cmp(). */
+	qsort(nodes, count, sizeof(*nodes), compare_nodes);
+
+	struct udev_list_entry *devs = NULL;
+	if (count > 0) {
+		devs = calloc(count, sizeof(*devs) + 32);
+		if (!devs) {
+			return -1;
+		}
+	}
+
+	char(*paths)[32] = (char(*)[32])(devs + count);
+	for (size_t i = 0; i < count; ++i) {
+		snprintf(paths[i], sizeof(paths[i]), "/dev/input/event%u",
+		    nodes[i]);
+		devs[i].name = paths[i];
+		devs[i].next = i + 1 < count ? &devs[i + 1] : NULL;
+		LOG("udev_enumerate_scan_devices, added %s\n", paths[i]);
+	}
+
+	free(udev_enumerate->devs);
+	udev_enumerate->devs = devs;
+	udev_enumerate->dev_count = count;
+	return 0;
+}
+
+static int
+scan_dev_nodes(struct udev_enumerate *udev_enumerate, bool *found)
+{
 	char path[32];
-	struct udev_list_entry **list_end = &udev_enumerate->dev_list;
+	unsigned nodes[100];
+	size_t count = 0;
+
+	for (unsigned i = 0; i < 100; ++i) {
+		snprintf(path, sizeof(path), "/dev/input/event%u", i);
+
+		if (access(path, R_OK) != 0) {
+			continue;
+		}
+
+		nodes[count++] = i;
+		if (found) {
+			found[i] = true;
+		}
+	}
+
+	return set_dev_nodes(udev_enumerate, nodes, count);
+}
+
+int
+udev_enumerate_scan_devices(struct udev_enumerate *udev_enumerate)
+{
+	LOG("udev_enumerate_scan_devices\n");
+
+	if (!udev_enumerate->scan_for_input) {
+		return 0;
+	}
+
+	struct live_set *set = NULL;
+	if (udev_enumerate->udev) {
+		set = live_set_acquire(udev_enumerate->udev);
+	}
+	if (set) {
+		unsigned nodes[100];
+		size_t count = 0;
+		for (unsigned i = 0; i < set->count && count < 100; ++i) {
+			nodes[count++] = set->nodes[i];
+		}
+		live_set_release(set);
+		return set_dev_nodes(udev_enumerate, nodes, count);
+	}
+
+	return scan_dev_nodes(udev_enumerate, NULL);
+}
+
+int
+udev_enumerate_scan_devices_with_monitor(
+    struct udev_enumerate *udev_enumerate, struct udev_monitor *udev_monitor)
+{
+	LOG("udev_enumerate_scan_devices_with_monitor\n");
+
+	if (udev_monitor->devd.running) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Once connected, devd queues every later event for us.  Scanning
+	 * after that point cannot miss a device; adds that were queued
+	 * for devices the scan already saw are dropped by the listener.
+	 * Without a connection there is no such point. */
+	devd_listener_connect(&udev_monitor->devd);
+	if (udev_monitor->devd.socket < 0) {
+		return -1;
+	}
+
+	if (udev_enumerate->scan_for_input &&
+	    scan_dev_nodes(udev_enumerate, udev_monitor->snapshot_nodes) < 0) {
+		return -1;
+	}
+
+	/* The consumer has seen exactly the scanned nodes. */
+	memcpy(udev_monitor->present, udev_monitor->snapshot_nodes,
+	    sizeof(udev_monitor->present));
+	return devd_listener_start(&udev_monitor->devd);
+}
+
+struct udev_list_entry *
+udev_enumerate_get_list_entry(struct udev_enumerate *udev_enumerate)
+{
+	return udev_enumerate->devs;
+}
+
+size_t
+udev_enumerate_get_count(struct udev_enumerate *udev_enumerate)
+{
+	return udev_enumerate->dev_count;
+}
+
+struct udev_list_entry *
+udev_enumerate_get_entry(struct udev_enumerate *udev_enumerate, size_t index)
+{
+	if (index >= udev_enumerate->dev_count) {
+		return NULL;
+	}
+	return &udev_enumerate->devs[index];
+}
+
+struct udev_list_entry *
+udev_enumerate_find_sysname(
+    struct udev_enumerate *udev_enumerate, char const *sysname)
+{
+	size_t lo = 0;
+	size_t hi = udev_enumerate->dev_count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		struct udev_list_entry *entry = &udev_enumerate->devs[mid];
+		int c = sysname_cmp(entry_sysname(entry), sysname);
+		if (c == 0) {
+			return entry;
+		}
+		if (c < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return NULL;
+}
+
+ssize_t
+udev_enumerate_serialize(
+    struct udev_enumerate *udev_enumerate, void *buf, size_t size)
+{
+	LOG("udev_enumerate_serialize\n");
+	size_t total = 0;
+
+	for (size_t i = 0; i < udev_enumerate->dev_count; ++i) {
+		struct udev_device *dev = udev_device_new_from_syspath(
+		    udev_enumerate->udev, udev_enumerate->devs[i].name);
+		if (!dev) {
+			continue;
+		}
+
+		/* Once a record did not fit, only sizes are computed. */
+		bool fits = total <= size;
+		ssize_t n = udev_device_serialize(dev,
+		    fits ? (char *)buf + total : NULL,
+		    fits ? size - total : 0);
+		udev_device_unref(dev);
+
+		/* Devices that cannot be probed are left out, like devices
+		 * that vanished since the scan. */
+		if (n > 0) {
+			total += (size_t)n;
+		}
+	}
+
+	if (total > SSIZE_MAX) {
+		errno = E2BIG;
+		return -1;
+	}
+	return (ssize_t)total;
+}
+
+int
+udev_enumerate_add_match_sysname(
+    struct udev_enumerate *udev_enumerate, const char *sysname)
+{
+	(void)udev_enumerate;
+	(void)sysname;
+	LOG("stub: udev_enumerate_add_match_sysname %s\n", sysname);
+	return -1;
+}
 
-	for (int i = 0; i < 100; ++i) {
-		snprintf(path, sizeof(path), "/dev/input/event%d", i);
+/* Only ID_SEAT is supported, it is answered from the tag index. */
+int
+udev_enumerate_add_match_property(struct udev_enumerate *udev_enumerate,
+    char const *property, char const *value)
+{
+	LOG("udev_enumerate_add_match_property %s %s\n", property, value);
 
-		if (access(path, R_OK) != 0) {
+	if (!property || !value || strcmp(property, "ID_SEAT") != 0 ||
+	    !udev_enumerate->udev) {
+		return -1;
+	}
+
+	char *seat = strdup(value);
+	if (!seat) {
+		return -1;
+	}
+	free(udev_enumerate->match_seat);
+	udev_enumerate->match_seat = seat;
+	return 0;
+}
+
+int
+udev_enumerate_add_match_tag(
+    struct udev_enumerate *udev_enumerate, char const *tag)
+{
+	LOG("udev_enumerate_add_match_tag %s\n", tag);
+
+	struct udev *udev = udev_enumerate->udev;
+	if (!tag || !udev) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&udev->lock);
+	rules_load(udev);
+	int bit = tag_bit(udev, tag, false);
+	pthread_mutex_unlock(&udev->lock);
+
+	/* No rule assigns the tag, so no device carries it. */
+	udev_enumerate->scan_for_input = 1;
+	if (bit < 0) {
+		udev_enumerate->no_match = true;
+	} else {
+		udev_enumerate->match_tags |= 1u << bit;
+	}
+	return 0;
+}
+
+void
+udev_enumerate_unref(struct udev_enumerate *udev_enumerate)
+{
+	LOG("udev_enumerate_unref\n");
+	if (refcount_dec(&udev_enumerate->refcount)) {
+		free(udev_enumerate->match_seat);
+		free(udev_enumerate->devs);
+		context_unref(udev_enumerate->udev);
+		free(udev_enumerate);
+	}
+}
+
+static struct udev_list_entry *
+create_list_entry_name_value(char const *name, char const *value)
+{
+	size_t name_size = strlen(name) + 1;
+	size_t value_size = value ? strlen(value) + 1 : 0;
+
+	struct udev_list_entry *le =
+	    calloc(1, sizeof(struct udev_list_entry) + name_size + value_size);
+	if (!le) {
+		return NULL;
+	}
+	char *strings = (char *)(le + 1);
+	memcpy(strings, name, name_size);
+	le->name = strings;
+	if (value) {
+		memcpy(strings + name_size, value, value_size);
+		le->value = strings + name_size;
+	}
+	return le;
+}
+
+static void
+free_dev_list(struct udev_list_entry **list)
+{
+	if (!*list) {
+		return;
+	}
+
+	if ((*list)->next) {
+		free_dev_list(&(*list)->next);
+	}
+
+	free(*list);
+	*list = NULL;
+}
+
+const char *
+udev_list_entry_get_name(struct udev_list_entry *list_entry)
+{
+	LOG("udev_list_entry_get_name\n");
+	return list_entry->name;
+}
+
+const char *
+udev_list_entry_get_value(struct udev_list_entry *list_entry)
+{
+	LOG("udev_list_entry_get_name\n");
+	return list_entry->value;
+}
+
+struct udev_list_entry *
+udev_list_entry_get_next(struct udev_list_entry *list_entry)
+{
+	return list_entry->next;
+}
+
+static int
+devd_listener_init(struct devd_listener *listener,
+    void (*on_event)(void *arg, char const *msg), void *arg)
+{
+	if (pipe2(listener->quit_fds, O_CLOEXEC) < 0) {
+		return -1;
+	}
+
+	listener->socket = -1;
+	listener->running = false;
+	listener->on_event = on_event;
+	listener->on_reconnect = NULL;
+	listener->arg = arg;
+	listener->wakeup_fd = -1;
+	listener->on_retry = NULL;
+	for (unsigned i = 0; i < 100; ++i) {
+		listener->pending[i] = false;
+		listener->pending_watch[i] = -1;
+	}
+	return 0;
+}
+
+/* Enables deferred nodes, see struct devd_listener. */
+static void
+devd_listener_enable_retry(struct devd_listener *listener,
+    void (*on_retry)(void *arg, unsigned node))
+{
+#if defined(HAVE_SYS_INOTIFY_H)
+	listener->wakeup_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#elif defined(USE_KQUEUE)
+	listener->wakeup_fd = kqueue();
+#endif
+	listener->on_retry = on_retry;
+}
+
+static void
+devd_listener_unwatch(struct devd_listener *listener, unsigned node)
+{
+	int watch = listener->pending_watch[node];
+	listener->pending[node] = false;
+	listener->pending_watch[node] = -1;
+
+#if defined(USE_KQUEUE)
+	/* Closing the descriptor removes its knote. */
+	if (watch >= 0) {
+		close(watch);
+	}
+#else
+	(void)watch;
+#endif
+}
+
+static void
+devd_listener_watch(
+    struct devd_listener *listener, unsigned node, char const *path)
+{
+	int watch = -1;
+
+	listener->pending[node] = true;
+	if (listener->wakeup_fd < 0) {
+		return;
+	}
+#if defined(HAVE_SYS_INOTIFY_H)
+	/* inotify needs read access to the watched file, which is exactly
+	 * what is missing.  Watch the directory instead; the watch is
+	 * shared by all nodes and lives as long as the descriptor. */
+	(void)path;
+	watch = inotify_add_watch(
+	    listener->wakeup_fd, "/dev/input", IN_ATTRIB);
+#elif defined(USE_KQUEUE)
+	watch = open(path, O_PATH | O_CLOEXEC);
+	if (watch >= 0) {
+		struct kevent kev;
+		EV_SET(&kev, watch, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+		    NOTE_ATTRIB | NOTE_DELETE, 0, NULL);
+		if (kevent(listener->wakeup_fd, &kev, 1, NULL, 0, NULL) < 0) {
+			close(watch);
+			watch = -1;
+		}
+	}
+#else
+	(void)path;
+#endif
+	listener->pending_watch[node] = watch;
+}
+
+/* Retries the pending nodes after a change of their attributes or, for
+ * nodes that could not be watched, on the listener timeout. */
+static void
+devd_listener_retry(struct devd_listener *listener, bool timeout)
+{
+	if (!timeout) {
+#if defined(HAVE_SYS_INOTIFY_H)
+		char buf[4096];
+		while (read(listener->wakeup_fd, buf, sizeof(buf)) > 0) {
+		}
+#elif defined(USE_KQUEUE)
+		struct kevent kev[8];
+		struct timespec zero = {0, 0};
+		while (kevent(listener->wakeup_fd, NULL, 0, kev, 8, &zero) >
+		    0) {
+		}
+#endif
+	}
+
+	for (unsigned node = 0; listener->on_retry && node < 100; ++node) {
+		if (listener->pending[node] &&
+		    (!timeout || listener->pending_watch[node] < 0)) {
+			listener->on_retry(listener->arg, node);
+		}
+	}
+}
+
+static void
+devd_listener_connect_to(struct devd_listener *listener, char const *path)
+{
+	struct sockaddr_un devd_addr;
+
+	memset(&devd_addr, 0, sizeof(devd_addr));
+	devd_addr.sun_family = PF_LOCAL;
+	snprintf(devd_addr.sun_path, sizeof(devd_addr.sun_path), "%s", path);
+
+	listener->socket = socket(PF_LOCAL, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (listener->socket < 0) {
+#ifdef LOGGING_ENABLED
+		int err = errno;
+#endif
+		LOG("devd_listener_connect socket error %d: %s", err,
+		    strerror(err));
+		return;
+	}
+
+	int error = connect(listener->socket, (struct sockaddr *)&devd_addr,
+	    (socklen_t)SUN_LEN(&devd_addr));
+	if (error < 0) {
+#ifdef LOGGING_ENABLED
+		int err = errno;
+#endif
+		close(listener->socket);
+		listener->socket = -1;
+		LOG("devd_listener_connect connect error %d: %s\n", err,
+		    strerror(err));
+	}
+}
+
+static void
+devd_listener_connect(struct devd_listener *listener)
+{
+	if (listener->socket >= 0) {
+		return;
+	}
+
+	char const *paths[2] = {getenv(DEVD_SOCKET_ENV), NULL};
+	if (!paths[0] || paths[0][0] == '\0') {
+		paths[0] = getenv(BROKER_SOCKET_ENV);
+		if (!paths[0] || paths[0][0] == '\0') {
+			paths[0] = BROKER_SOCKET_PATH;
+		}
+		paths[1] = DEVD_SOCKET_PATH;
+	}
+
+	for (unsigned i = 0; i < 2 && paths[i]; ++i) {
+		devd_listener_connect_to(listener, paths[i]);
+		if (listener->socket >= 0) {
+			LOG("devd_listener_connect connected to %s\n",
+			    paths[i]);
+			return;
+		}
+	}
+}
+
+static void *
+devd_listener_thread(void *arg)
+{
+	struct devd_listener *listener = (struct devd_listener *)arg;
+
+	LOG("udev_devd_listener start\n");
+
+	/* Everything before the first connection is lost as well. */
+	bool lost = listener->socket < 0;
+
+	for (;;) {
+		ssize_t len;
+		char event[1024];
+
+		devd_listener_connect(listener);
+		if (lost && listener->socket >= 0) {
+			lost = false;
+			if (listener->on_reconnect) {
+				listener->on_reconnect(listener->arg);
+			}
+		}
+
+		struct pollfd pfd[3] = {{listener->socket, POLLIN, 0},
+		    {listener->quit_fds[0], POLLIN, 0},
+		    {listener->wakeup_fd, POLLIN, 0}};
+		int ret;
+		do {
+			ret = poll(pfd, 3, 1000);
+		} while (ret < 0 && errno == EINTR);
+
+		if (ret == 0) {
+			devd_listener_retry(listener, true);
 			continue;
 		}
 
-		struct udev_list_entry *le = create_list_entry_name(path);
-		if (!le) {
-			free_dev_list(&udev_enumerate->dev_list);
-			return -1;
+		if (ret > 0 && pfd[1].revents) {
+			LOG("udev_devd_listener quit\n");
+			return NULL;
+		}
+
+		if (ret > 0 && pfd[2].revents) {
+			devd_listener_retry(listener, false);
+			if (!pfd[0].revents) {
+				continue;
+			}
+		}
+
+		if (ret < 0 || !(pfd[0].revents & POLLIN)) {
+			int err = errno;
+			LOG("udev_devd_listener return poll error %d: %s\n",
+			    err, strerror(err));
+			(void)err;
+			return NULL;
+		}
+
+		len = recv(listener->socket, event, sizeof(event) - 1,
+		    MSG_WAITALL);
+		if (len < 0) {
+#ifdef LOGGING_ENABLED
+			int err = errno;
+#endif
+			LOG("udev_devd_listener recv error %d: %s", err,
+			    strerror(err));
+			return (void *)1;
+		}
+
+		if (len == 0) {
+			LOG("udev_devd_listener socket EOF\n");
+			close(listener->socket);
+			listener->socket = -1;
+			lost = true;
+			continue;
+		}
+
+		LOG("udev_devd_listener event: %s len: %d\n", event, (int)len);
+
+		event[len] = '\0';
+
+		if (len >= 1 && event[len - 1] == '\n') {
+			event[len - 1] = '\0';
 		}
 
-		LOG("udev_enumerate_scan_devices, added %s\n", path);
+		char *device = strstr(event, "cdev=input/event");
+		if (!device) {
+			continue;
+		}
 
-		while (*list_end) {
-			list_end = &((*list_end)->next);
+		char msg[32] = {0};
+		snprintf(&msg[1], sizeof(msg) - 1, "%s", device + 5);
+		if (strstr(event, "type=CREATE") != NULL) {
+			msg[0] = '+';
+		} else if (strstr(event, "type=DESTROY") != NULL) {
+			msg[0] = '-';
+		} else {
+			continue;
 		}
 
-		*list_end = le;
+		listener->on_event(listener->arg, msg);
+	}
+
+	return NULL;
+}
+
+static int
+devd_listener_start(struct devd_listener *listener)
+{
+	devd_listener_connect(listener);
+
+	if (pthread_create(&listener->thread, NULL, devd_listener_thread,
+		listener) != 0) {
+		return -1;
 	}
 
+	listener->running = true;
 	return 0;
 }
 
-struct udev_list_entry *
-udev_enumerate_get_list_entry(struct udev_enumerate *udev_enumerate)
+static void
+devd_listener_stop(struct devd_listener *listener)
+{
+	if (listener->running) {
+		write(listener->quit_fds[1], "", 1);
+		pthread_join(listener->thread, NULL);
+		listener->running = false;
+	}
+	if (listener->socket >= 0) {
+		close(listener->socket);
+		listener->socket = -1;
+	}
+}
+
+static void
+devd_listener_fini(struct devd_listener *listener)
+{
+	devd_listener_stop(listener);
+	close(listener->quit_fds[0]);
+	close(listener->quit_fds[1]);
+	for (unsigned node = 0; node < 100; ++node) {
+		devd_listener_unwatch(listener, node);
+	}
+	if (listener->wakeup_fd >= 0) {
+		close(listener->wakeup_fd);
+		listener->wakeup_fd = -1;
+	}
+}
+
+static void
+live_set_release(struct live_set *set)
+{
+	if (set && refcount_dec(&set->refcount)) {
+		free(set);
+	}
+}
+
+static struct live_set *
+live_set_acquire(struct udev *udev)
 {
-	return udev_enumerate->dev_list;
+	/* The reader count keeps the updater from dropping the set between
+	 * our load and our refcount increment. */
+	atomic_fetch_add(&udev->live_readers, 1);
+	struct live_set *set = atomic_load(&udev->live_set);
+	if (set) {
+		refcount_inc(&set->refcount);
+	}
+	atomic_fetch_sub(&udev->live_readers, 1);
+	return set;
 }
 
-int
-udev_enumerate_add_match_sysname(
-    struct udev_enumerate *udev_enumerate, const char *sysname)
+static void
+live_set_publish(struct udev *udev, struct live_set *set)
 {
-	(void)udev_enumerate;
-	(void)sysname;
-	LOG("stub: udev_enumerate_add_match_sysname %s\n", sysname);
-	return -1;
+	struct live_set *old = atomic_exchange(&udev->live_set, set);
+
+	/* Grace period: wait for readers that may have loaded the old
+	 * pointer but not yet taken a reference.  Readers never wait. */
+	while (atomic_load(&udev->live_readers) != 0) {
+		sched_yield();
+	}
+
+	live_set_release(old);
 }
 
-int
-udev_enumerate_add_match_property(struct udev_enumerate *udev_enumerate,
-    char const *property, char const *value)
+static struct live_set *
+live_set_new(unsigned capacity)
 {
-	(void)udev_enumerate;
-	(void)property;
-	(void)value;
-	LOG("stub: udev_enumerate_add_match_property %s %s\n", property,
-	    value);
-	return -1;
+	struct live_set *set =
+	    calloc(1, sizeof(struct live_set) + capacity * sizeof(unsigned));
+	if (set) {
+		atomic_init(&set->refcount, 1);
+	}
+	return set;
 }
 
-void
-udev_enumerate_unref(struct udev_enumerate *udev_enumerate)
+/*
+ * Returns whether a node can be read, which is what enumeration requires.
+ * Nodes that exist but cannot be read yet are watched until they can.
+ */
+static bool
+live_node_ready(struct devd_listener *listener, unsigned node)
 {
-	LOG("udev_enumerate_unref\n");
-	--udev_enumerate->refcount;
-	if (udev_enumerate->refcount == 0) {
-		free_dev_list(&udev_enumerate->dev_list);
-		free(udev_enumerate);
+	char path[32];
+	snprintf(path, sizeof(path), "/dev/input/event%u", node);
+
+	for (;;) {
+		bool ready = access(path, R_OK) == 0;
+		bool exists = ready || errno == EACCES || errno == EPERM;
+		if (node >= 100) {
+			return ready;
+		}
+		if (ready || !exists) {
+			devd_listener_unwatch(listener, node);
+			return ready;
+		}
+		if (listener->pending[node]) {
+			return false;
+		}
+
+		/* Watch first, then check once more, so that a permission
+		 * change in between is not missed. */
+		LOG("live_node_ready defer: %s\n", path);
+		devd_listener_watch(listener, node, path);
 	}
 }
 
-static struct udev_list_entry *
-create_list_entry_name_value(char const *name, char const *value)
+/* Scans all nodes into a new set. */
+static struct live_set *
+live_scan(struct devd_listener *listener)
 {
-	struct udev_list_entry *le = calloc(1, sizeof(struct udev_list_entry));
-	if (!le) {
+	struct live_set *set = live_set_new(100);
+	if (!set) {
 		return NULL;
 	}
-	snprintf(le->name, sizeof(le->name), "%s", name);
-	if (value) {
-		le->has_value = 1;
-		snprintf(le->value, sizeof(le->value), "%s", value);
+
+	for (unsigned i = 0; i < 100; ++i) {
+		if (live_node_ready(listener, i)) {
+			set->nodes[set->count++] = i;
+		}
 	}
-	return le;
+	return set;
 }
 
-static struct udev_list_entry *
-create_list_entry_name(char const *name)
+static void
+live_set_update(struct udev *udev, unsigned node, bool add)
 {
-	return create_list_entry_name_value(name, NULL);
+	/* Only this thread updates the set, so it can be read without
+	 * taking a reference. */
+	struct live_set *old = atomic_load(&udev->live_set);
+	struct live_set *set = live_set_new(old->count + 1);
+	if (!set) {
+		return;
+	}
+
+	bool inserted = false;
+	bool removed = false;
+	for (unsigned i = 0; i < old->count; ++i) {
+		if (old->nodes[i] == node) {
+			if (add) {
+				free(set);
+				return;
+			}
+			removed = true;
+			continue;
+		}
+		if (add && !inserted && old->nodes[i] > node) {
+			set->nodes[set->count++] = node;
+			inserted = true;
+		}
+		set->nodes[set->count++] = old->nodes[i];
+	}
+	if (add && !inserted) {
+		set->nodes[set->count++] = node;
+	}
+	if (!add && !removed) {
+		free(set);
+		return;
+	}
+
+	LOG("live_set_update %c%u, %u devices\n", add ? '+' : '-', node,
+	    set->count);
+
+	live_set_publish(udev, set);
 }
 
 static void
-free_dev_list(struct udev_list_entry **list)
+live_on_event(void *arg, char const *msg)
 {
-	if (!*list) {
+	struct udev *udev = (struct udev *)arg;
+	unsigned node;
+
+	if (sscanf(&msg[1], "input/event%u", &node) != 1) {
 		return;
 	}
 
-	if ((*list)->next) {
-		free_dev_list(&(*list)->next);
+	if (msg[0] == '+') {
+		if (live_node_ready(&udev->live_listener, node)) {
+			live_set_update(udev, node, true);
+		}
+		return;
 	}
 
-	free(*list);
-	*list = NULL;
+	if (node < 100) {
+		devd_listener_unwatch(&udev->live_listener, node);
+	}
+	live_set_update(udev, node, false);
 }
 
-const char *
-udev_list_entry_get_name(struct udev_list_entry *list_entry)
+static void
+live_on_retry(void *arg, unsigned node)
 {
-	LOG("udev_list_entry_get_name\n");
-	return list_entry->name;
+	struct udev *udev = (struct udev *)arg;
+
+	if (live_node_ready(&udev->live_listener, node)) {
+		live_set_update(udev, node, true);
+	}
 }
 
-const char *
-udev_list_entry_get_value(struct udev_list_entry *list_entry)
+/* Events were lost while the connection was down; start over. */
+static void
+live_on_reconnect(void *arg)
 {
-	LOG("udev_list_entry_get_name\n");
-	return list_entry->has_value ? list_entry->value : NULL;
+	struct udev *udev = (struct udev *)arg;
+
+	struct live_set *set = live_scan(&udev->live_listener);
+	if (set) {
+		LOG("live_on_reconnect, %u devices\n", set->count);
+		live_set_publish(udev, set);
+	}
 }
 
-struct udev_list_entry *
-udev_list_entry_get_next(struct udev_list_entry *list_entry)
+int
+udev_enable_fd_handoff(
+    struct udev *udev, unsigned max_fds, unsigned idle_timeout_ms)
 {
-	return list_entry->next;
+	LOG("udev_enable_fd_handoff %u %u\n", max_fds, idle_timeout_ms);
+
+	pthread_mutex_lock(&udev->lock);
+	udev->fd_cache_max = max_fds;
+	udev->fd_idle_usec = (uint64_t)idle_timeout_ms * 1000u;
+	fd_cache_expire(udev);
+	fd_cache_trim(udev, max_fds);
+	pthread_mutex_unlock(&udev->lock);
+	return 0;
+}
+
+int
+udev_enable_live_enumeration(struct udev *udev)
+{
+	LOG("udev_enable_live_enumeration\n");
+
+	if (udev->live_enabled) {
+		return 0;
+	}
+
+	if (devd_listener_init(&udev->live_listener, live_on_event, udev) <
+	    0) {
+		return -1;
+	}
+	udev->live_listener.on_reconnect = live_on_reconnect;
+	devd_listener_enable_retry(&udev->live_listener, live_on_retry);
+
+	/* Connect before scanning, so no event falls between the scan and
+	 * the first update. */
+	devd_listener_connect(&udev->live_listener);
+	if (udev->live_listener.socket < 0) {
+		devd_listener_fini(&udev->live_listener);
+		return -1;
+	}
+
+	struct live_set *set = live_scan(&udev->live_listener);
+	if (!set) {
+		devd_listener_fini(&udev->live_listener);
+		return -1;
+	}
+
+	atomic_store(&udev->live_set, set);
+
+	if (devd_listener_start(&udev->live_listener) < 0) {
+		live_set_release(atomic_exchange(&udev->live_set, NULL));
+		devd_listener_fini(&udev->live_listener);
+		return -1;
+	}
+
+	udev->live_enabled = true;
+	return 0;
 }
 
 struct udev_monitor *
@@ -650,16 +3467,25 @@ udev_monitor_new_from_netlink(struct udev *udev, const char *name)
 		return NULL;
 	}
 
-	if (pipe2(u->pipe_fds, O_CLOEXEC) < 0) {
+	/* Like a netlink socket, the event pipe never blocks.  The listener
+	 * must not stall on a consumer that stopped reading. */
+	if (pipe2(u->pipe_fds, O_CLOEXEC | O_NONBLOCK) < 0) {
+		free(u);
+		return NULL;
+	}
+
+	if (devd_listener_init(&u->devd, monitor_on_event, u) < 0) {
+		close(u->pipe_fds[0]);
+		close(u->pipe_fds[1]);
 		free(u);
 		return NULL;
 	}
 
-	// TODO(jan): increase refcount?
-	u->udev = udev;
-	u->devd_socket = -1;
-	u->is_receiving = 0;
-	u->refcount = 1;
+	u->devd.on_reconnect = monitor_on_reconnect;
+	devd_listener_enable_retry(&u->devd, monitor_on_retry);
+
+	u->udev = context_ref(udev);
+	atomic_init(&u->refcount, 1);
 
 	return u;
 }
@@ -683,122 +3509,232 @@ udev_monitor_filter_add_match_subsystem_devtype(
 	return 0;
 }
 
-static void *
-devd_listener(void *arg)
+int
+udev_monitor_filter_add_match_tag(
+    struct udev_monitor *udev_monitor, char const *tag)
 {
-	struct udev_monitor *udev_monitor = (struct udev_monitor *)arg;
+	LOG("udev_monitor_filter_add_match_tag %s\n", tag);
 
-	LOG("udev_devd_listener start\n");
+	struct udev *udev = udev_monitor->udev;
+	if (!tag || !udev || udev_monitor->devd.running) {
+		return -1;
+	}
 
-	struct sockaddr_un devd_addr;
+	pthread_mutex_lock(&udev->lock);
+	rules_load(udev);
+	int bit = tag_bit(udev, tag, false);
+	pthread_mutex_unlock(&udev->lock);
 
-	memset(&devd_addr, 0, sizeof(devd_addr));
-	devd_addr.sun_family = PF_LOCAL;
-	snprintf(devd_addr.sun_path, sizeof(devd_addr.sun_path),
-	    "/var/run/devd.seqpacket.pipe");
+	/* Tagged devices are input devices, the tag implies the subsystem
+	 * match. */
+	udev_monitor->scan_for_input = 1;
+	if (bit < 0) {
+		udev_monitor->no_match = true;
+	} else {
+		udev_monitor->match_tags |= 1u << bit;
+	}
+	return 0;
+}
+
+/* Every event that passes the filters gets the next sequence number, even
+ * if it is dropped, so that consumers can detect the loss. */
+static void
+monitor_deliver(struct udev_monitor *udev_monitor,
+    struct udev_device *udev_device, char const *action, uint64_t usec)
+{
+	unsigned node = node_from_syspath(udev_device->syspath);
+	if (node < 100) {
+		udev_monitor->present[node] = strcmp(action, "add") == 0;
+	}
+
+	if (udev_monitor->no_match ||
+	    (udev_device->tags & udev_monitor->match_tags) !=
+		udev_monitor->match_tags) {
+		udev_device_unref(udev_device);
+		return;
+	}
+
+	udev_device->action = action;
+	udev_device->seqnum = ++udev_monitor->seqnum;
+	udev_device->usec_initialized = usec;
+
+	LOG("udev_devd_listener deliver: %llu %s %s\n", udev_device->seqnum,
+	    action, udev_device->syspath);
+
+	if (write(udev_monitor->pipe_fds[1], &udev_device,
+		sizeof(udev_device)) != (ssize_t)sizeof(udev_device)) {
+		LOG("udev_devd_listener queue full, dropping event\n");
+		udev_device_unref(udev_device);
+	}
+}
+
+/* Probes a new node and delivers the add once the node can be opened.
+ * usec is the time devd reported the node. */
+static void
+monitor_probe_add(
+    struct udev_monitor *udev_monitor, unsigned node, uint64_t usec)
+{
+	char path[32];
+	snprintf(path, sizeof(path), "/dev/input/event%u", node);
 
 	for (;;) {
-		ssize_t len;
-		char event[1024];
+		struct udev_device *udev_device =
+		    udev_device_new_from_syspath(udev_monitor->udev, path);
 
-		if (udev_monitor->devd_socket < 0) {
-			udev_monitor->devd_socket =
-			    socket(PF_LOCAL, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
-			if (udev_monitor->devd_socket < 0) {
-#ifdef LOGGING_ENABLED
-				int err = errno;
-#endif
-				LOG("udev_monitor_enable_receiving socket "
-				    "error %d: %s",
-				    err, strerror(err));
-				return (void *)1;
+		/* Consumers of add events want the properties anyway;
+		 * probing here also tells whether the node is ready. */
+		if (!udev_device ||
+		    (device_probe(udev_device) < 0 &&
+			!udev_device->uninitialized)) {
+			if (udev_device) {
+				udev_device_unref(udev_device);
 			}
-
-			int error = connect(udev_monitor->devd_socket,
-			    (struct sockaddr *)&devd_addr,
-			    (socklen_t)SUN_LEN(&devd_addr));
-			if (error < 0) {
-#ifdef LOGGING_ENABLED
-				int err = errno;
-#endif
-				close(udev_monitor->devd_socket);
-				udev_monitor->devd_socket = -1;
-				LOG("udev_monitor_enable_receiving connect "
-				    "error %d: %s\n",
-				    err, strerror(err));
+			if (node < 100) {
+				devd_listener_unwatch(
+				    &udev_monitor->devd, node);
 			}
+			return;
 		}
 
-		struct pollfd pfd[2] = {{udev_monitor->devd_socket, POLLIN, 0},
-		    {udev_monitor->pipe_fds[1], POLLIN, 0}};
-		int ret;
-		do {
-			ret = poll(pfd, 2, 1000);
-		} while (ret < 0 && errno == EINTR);
-
-		if (ret == 0) {
-			continue;
+		if (!udev_device->uninitialized) {
+			if (node < 100) {
+				devd_listener_unwatch(
+				    &udev_monitor->devd, node);
+			}
+			monitor_deliver(
+			    udev_monitor, udev_device, "add", usec);
+			return;
 		}
 
-		if (ret < 0 || !(pfd[0].revents & POLLIN)) {
-			int err = errno;
-			LOG("udev_devd_listener return poll error %d: %s\n",
-			    err, strerror(err));
-			(void)err;
-			return NULL;
+		udev_device_unref(udev_device);
+		if (node >= 100 || udev_monitor->devd.pending[node]) {
+			return;
 		}
 
-		len = recv(udev_monitor->devd_socket, event, sizeof(event) - 1,
-		    MSG_WAITALL);
-		if (len < 0) {
-#ifdef LOGGING_ENABLED
-			int err = errno;
-#endif
-			LOG("udev_devd_listener recv error %d: %s", err,
-			    strerror(err));
-			return (void *)1;
-		}
+		/* Watch first, then probe once more, so that a permission
+		 * change in between is not missed. */
+		LOG("udev_devd_listener defer: %s\n", path);
+		udev_monitor->pending_usec[node] = usec;
+		devd_listener_watch(&udev_monitor->devd, node, path);
+	}
+}
 
-		if (len == 0) {
-			LOG("udev_devd_listener socket EOF\n");
-			close(udev_monitor->devd_socket);
-			udev_monitor->devd_socket = -1;
-			continue;
-		}
+static void
+monitor_on_retry(void *arg, unsigned node)
+{
+	struct udev_monitor *udev_monitor = (struct udev_monitor *)arg;
 
-		LOG("udev_devd_listener event: %s len: %d\n", event, (int)len);
+	monitor_probe_add(
+	    udev_monitor, node, udev_monitor->pending_usec[node]);
+}
 
-		if (!udev_monitor->scan_for_input) {
-			continue;
-		}
+static void
+monitor_remove(struct udev_monitor *udev_monitor, unsigned node, uint64_t usec)
+{
+	char path[32];
+	snprintf(path, sizeof(path), "/dev/input/event%u", node);
 
-		event[len] = '\0';
+	struct udev_device *udev_device = udev_device_new_from_syspath_impl(
+	    udev_monitor->udev, path, false);
+	if (!udev_device) {
+		return;
+	}
 
-		if (len >= 1 && event[len - 1] == '\n') {
-			event[len - 1] = '\0';
+	/* The node is gone, its tags are the last ones indexed. */
+	struct udev *udev = udev_monitor->udev;
+	if (udev && node < 100) {
+		pthread_mutex_lock(&udev->lock);
+		if (udev->tag_index[node].valid) {
+			udev_device->tags = udev->tag_index[node].tags;
+			udev_device->seat = udev->tag_index[node].seat;
 		}
+		pthread_mutex_unlock(&udev->lock);
+	}
+	monitor_deliver(udev_monitor, udev_device, "remove", usec);
+}
 
-		char *device = strstr(event, "cdev=input/event");
-		if (!device) {
-			continue;
+static void
+monitor_scan_present(struct udev_monitor *udev_monitor)
+{
+	char path[32];
+
+	for (unsigned i = 0; i < 100; ++i) {
+		snprintf(path, sizeof(path), "/dev/input/event%u", i);
+		udev_monitor->present[i] = access(path, R_OK) == 0;
+	}
+}
+
+/* Events may have been lost while devd was unreachable.  Leave a gap in
+ * the sequence numbers, then compare /dev/input with what the consumer
+ * has seen and report the difference as add and remove events. */
+static void
+monitor_on_reconnect(void *arg)
+{
+	struct udev_monitor *udev_monitor = (struct udev_monitor *)arg;
+	uint64_t usec = now_usec();
+
+	LOG("udev_devd_listener reconnected\n");
+	++udev_monitor->seqnum;
+
+	if (!udev_monitor->scan_for_input) {
+		return;
+	}
+
+	/* Adds queued on the old connection are gone with it. */
+	memset(udev_monitor->snapshot_nodes, 0,
+	    sizeof(udev_monitor->snapshot_nodes));
+
+	char path[32];
+	for (unsigned node = 0; node < 100; ++node) {
+		snprintf(path, sizeof(path), "/dev/input/event%u", node);
+		bool exists = access(path, F_OK) == 0;
+
+		if (udev_monitor->present[node] && !exists) {
+			monitor_remove(udev_monitor, node, usec);
+		} else if (udev_monitor->devd.pending[node] && !exists) {
+			devd_listener_unwatch(&udev_monitor->devd, node);
+		} else if (!udev_monitor->present[node] &&
+		    !udev_monitor->devd.pending[node] && exists) {
+			monitor_probe_add(udev_monitor, node, usec);
 		}
+	}
+}
 
-		char msg[32] = {0};
-		snprintf(&msg[1], sizeof(msg) - 1, "%s", device + 5);
-		if (strstr(event, "type=CREATE") != NULL) {
-			msg[0] = '+';
-		} else if (strstr(event, "type=DESTROY") != NULL) {
-			msg[0] = '-';
-		} else {
-			continue;
+static void
+monitor_on_event(void *arg, char const *msg)
+{
+	struct udev_monitor *udev_monitor = (struct udev_monitor *)arg;
+	uint64_t usec = now_usec();
+
+	if (!udev_monitor->scan_for_input) {
+		return;
+	}
+
+	unsigned node;
+	if (sscanf(&msg[1], "input/event%u", &node) != 1) {
+		return;
+	}
+
+	if (node < 100 && udev_monitor->snapshot_nodes[node]) {
+		udev_monitor->snapshot_nodes[node] = false;
+		if (msg[0] == '+') {
+			LOG("udev_devd_listener drop duplicate: %s\n", msg);
+			return;
 		}
+	}
 
-		LOG("udev_devd_listener write: %s\n", msg);
+	if (msg[0] == '+') {
+		monitor_probe_add(udev_monitor, node, usec);
+		return;
+	}
 
-		write(udev_monitor->pipe_fds[1], msg, 32);
+	/* The consumer never saw an add for a pending node. */
+	if (node < 100 && udev_monitor->devd.pending[node]) {
+		devd_listener_unwatch(&udev_monitor->devd, node);
+		return;
 	}
 
-	return NULL;
+	monitor_remove(udev_monitor, node, usec);
 }
 
 int
@@ -806,15 +3742,20 @@ udev_monitor_enable_receiving(struct udev_monitor *udev_monitor)
 {
 	LOG("udev_monitor_enable_receiving\n");
 
-	udev_monitor->is_receiving = 1;
-
-	if (pthread_create(&udev_monitor->devd_thread, NULL, devd_listener,
-		udev_monitor) == 0) {
+	/* Already receiving, e.g. after scanning with this monitor; a second
+	 * listener would race the first on the socket and the node state. */
+	if (udev_monitor->devd.running) {
 		return 0;
 	}
 
-	udev_monitor->is_receiving = 0;
-	return -1;
+	/* As for scanning with a monitor, connect first so the baseline
+	 * of present nodes misses no event. */
+	if (udev_monitor->scan_for_input) {
+		devd_listener_connect(&udev_monitor->devd);
+		monitor_scan_present(udev_monitor);
+	}
+
+	return devd_listener_start(&udev_monitor->devd);
 }
 
 int
@@ -836,39 +3777,15 @@ udev_monitor_receive_device(struct udev_monitor *udev_monitor)
 {
 	LOG("udev_monitor_receive_device\n");
 
-	char msg[32];
-	if (read(udev_monitor->pipe_fds[0], msg, 32) != 32) {
+	/* The listener hands over fully probed devices. */
+	struct udev_device *udev_device;
+	if (read(udev_monitor->pipe_fds[0], &udev_device,
+		sizeof(udev_device)) != (ssize_t)sizeof(udev_device)) {
 		return NULL;
 	}
 
-	LOG("udev_monitor_receive_device msg: %s\n", msg);
-
-	char path[32];
-	snprintf(path, sizeof(path), "/dev/%s", &msg[1]);
-
-	struct udev_device *udev_device = NULL;
-
-	if (msg[0] == '+') {
-		udev_device =
-		    udev_device_new_from_syspath(udev_monitor->udev, path);
-
-		if (!udev_device) {
-			return NULL;
-		}
-
-		udev_device->action = "add";
-		LOG("udev_monitor_receive_device add %s\n", path);
-	} else if (msg[0] == '-') {
-		udev_device = udev_device_new_from_syspath_impl(
-		    udev_monitor->udev, path, false);
-
-		if (!udev_device) {
-			return NULL;
-		}
-
-		udev_device->action = "remove";
-		LOG("udev_monitor_receive_device remove %s\n", path);
-	}
+	LOG("udev_monitor_receive_device %s %s\n", udev_device->action,
+	    udev_device->syspath);
 
 	return udev_device;
 }
@@ -877,18 +3794,18 @@ void
 udev_monitor_unref(struct udev_monitor *udev_monitor)
 {
 	LOG("udev_monitor_unref\n");
-	--udev_monitor->refcount;
-	if (udev_monitor->refcount == 0) {
-		if (udev_monitor->is_receiving) {
-			write(udev_monitor->pipe_fds[0], "", 1);
-			pthread_join(udev_monitor->devd_thread, NULL);
-			if (udev_monitor->devd_socket >= 0) {
-				close(udev_monitor->devd_socket);
-				udev_monitor->devd_socket = -1;
-			}
+	if (refcount_dec(&udev_monitor->refcount)) {
+		devd_listener_fini(&udev_monitor->devd);
+
+		struct udev_device *udev_device;
+		while (read(udev_monitor->pipe_fds[0], &udev_device,
+			   sizeof(udev_device)) ==
+		    (ssize_t)sizeof(udev_device)) {
+			udev_device_unref(udev_device);
 		}
 		close(udev_monitor->pipe_fds[0]);
 		close(udev_monitor->pipe_fds[1]);
+		context_unref(udev_monitor->udev);
 		free(udev_monitor);
 	}
 }
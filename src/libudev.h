@@ -17,6 +17,22 @@ struct udev *udev_new(void);
 struct udev *udev_ref(struct udev *udev);
 void udev_unref(struct udev *udev);
 
+/*
+ * Keep an incrementally updated set of input devices, driven by devd, and
+ * serve udev_enumerate_scan_devices() from it without touching the file
+ * system.  Returns a negative value if devd is not reachable.
+ */
+int udev_enable_live_enumeration(struct udev *udev);
+
+/*
+ * Keep the descriptor opened while probing a device, so the consumer can
+ * take it with udev_device_take_fd() instead of opening the node a second
+ * time.  At most max_fds descriptors are kept, each for at most
+ * idle_timeout_ms; max_fds 0 disables the handoff.
+ */
+int udev_enable_fd_handoff(
+    struct udev *udev, unsigned max_fds, unsigned idle_timeout_ms);
+
 char const *udev_device_get_devnode(struct udev_device *udev_device);
 dev_t udev_device_get_devnum(struct udev_device *udev_device);
 char const *udev_device_get_property_value(
@@ -29,6 +45,7 @@ struct udev_device *udev_device_new_from_devnum(
 char const *udev_device_get_syspath(struct udev_device *udev_device);
 char const *udev_device_get_sysname(struct udev_device *udev_device);
 char const *udev_device_get_subsystem(struct udev_device *udev_device);
+char const *udev_device_get_devtype(struct udev_device *udev_device);
 char const *udev_device_get_sysattr_value(
     struct udev_device *udev_device, char const *sysattr);
 struct udev_list_entry *udev_device_get_properties_list_entry(
@@ -38,10 +55,55 @@ void udev_device_unref(struct udev_device *udev_device);
 struct udev_device *udev_device_get_parent(struct udev_device *udev_device);
 int udev_device_get_is_initialized(struct udev_device *udev_device);
 char const *udev_device_get_action(struct udev_device *udev_device);
+
+/*
+ * Tags and the seat (ID_SEAT, seat0 if unset) are assigned by the rules
+ * in the tags file, see udev_enumerate_add_match_tag().
+ */
+int udev_device_has_tag(struct udev_device *udev_device, char const *tag);
+
+/*
+ * Events of a monitor are numbered from 1.  A gap means events were lost,
+ * either because the consumer fell behind or because the connection to
+ * devd was down for a while.  Each monitor counts on its own; events of
+ * different monitors are ordered by the time they were received, see
+ * udev_device_get_usec_since_initialized().
+ */
+unsigned long long udev_device_get_seqnum(struct udev_device *udev_device);
+
+/*
+ * Transfers ownership of the descriptor kept by the probe to the caller.
+ * It is opened O_NONBLOCK, and O_RDWR unless only reading was permitted.
+ * Returns -1 with errno ENOENT if there is none (handoff disabled, the
+ * device came from the snapshot, the descriptor expired or was taken).
+ */
+int udev_device_take_fd(struct udev_device *udev_device);
+unsigned long long udev_device_get_usec_since_initialized(
+    struct udev_device *udev_device);
 struct udev_device *udev_device_get_parent_with_subsystem_devtype(
     struct udev_device *udev_device, char const *subsystem,
     char const *devtype);
 
+/*
+ * Writes a flat, relocatable record of the device (syspath, devnum,
+ * properties and everything its parents and sysattrs are derived from) to
+ * buf.  Returns the size of the record, or -1 if the device cannot be
+ * probed.  Nothing is written if the record is larger than size, so
+ * calling with size 0 asks for the size.
+ */
+ssize_t udev_device_serialize(
+    struct udev_device *udev_device, void *buf, size_t size);
+
+/*
+ * Wraps a record written by udev_device_serialize() as a read-only device,
+ * without copying it.  buf must be 8-byte aligned and stay unchanged until
+ * the device and its parents are released; the device never opens its
+ * node.  If used is not NULL, it receives the size of the record, which is
+ * where the next one starts in the output of udev_enumerate_serialize().
+ */
+struct udev_device *udev_device_new_from_buffer(
+    struct udev *udev, void const *buf, size_t size, size_t *used);
+
 struct udev_enumerate *udev_enumerate_new(struct udev *udev);
 int udev_enumerate_add_match_subsystem(
     struct udev_enumerate *udev_enumerate, char const *subsystem);
@@ -52,8 +114,52 @@ int udev_enumerate_add_match_sysname(
     struct udev_enumerate *udev_enumerate, char const *sysname);
 int udev_enumerate_add_match_property(struct udev_enumerate *udev_enumerate,
     char const *property, char const *value);
+
+/*
+ * Restricts the scan to devices carrying the tag.  Tags come from the tags
+ * file, one rule per line: whitespace-separated name=, phys= and vendor=
+ * glob patterns (vendor as four hex digits) plus tag=a,b and seat=name,
+ * which also adds the tag "seat".  The matching is answered from an index
+ * kept by the context; devices probed before cost a stat each, so a seat
+ * is enumerated without opening the nodes of other seats.  ID_SEAT is the
+ * only property udev_enumerate_add_match_property() matches, from the same
+ * index.
+ */
+int udev_enumerate_add_match_tag(
+    struct udev_enumerate *udev_enumerate, char const *tag);
 void udev_enumerate_unref(struct udev_enumerate *udev_enumerate);
 
+/*
+ * The results of the last scan are kept sorted by sysname, with digit runs
+ * compared by value ("event2" before "event10").  Entries stay valid until
+ * the next scan or the last unref.
+ */
+size_t udev_enumerate_get_count(struct udev_enumerate *udev_enumerate);
+struct udev_list_entry *udev_enumerate_get_entry(
+    struct udev_enumerate *udev_enumerate, size_t index);
+struct udev_list_entry *udev_enumerate_find_sysname(
+    struct udev_enumerate *udev_enumerate, char const *sysname);
+
+/*
+ * Serializes all devices of the last scan as consecutive records, see
+ * udev_device_serialize().  Devices that cannot be probed are left out.
+ * Returns the size of all records; if that exceeds size, the records up to
+ * the first one that did not fit were written.
+ */
+ssize_t udev_enumerate_serialize(
+    struct udev_enumerate *udev_enumerate, void *buf, size_t size);
+
+/*
+ * Scan devices and start receiving on a not yet enabled monitor, such that
+ * the monitor reports exactly the events after the scan: no device is
+ * missed and none is reported both by the scan and as an add event.
+ * Returns a negative value without scanning if devd is not reachable.
+ * The monitor is then receiving; udev_monitor_enable_receiving() on it is
+ * a no-op.
+ */
+int udev_enumerate_scan_devices_with_monitor(
+    struct udev_enumerate *udev_enumerate, struct udev_monitor *udev_monitor);
+
 #define udev_list_entry_foreach(list_entry, first_entry)                      \
 	for ((list_entry) = first_entry; (list_entry);                        \
 	     (list_entry) = udev_list_entry_get_next((list_entry)))
@@ -67,6 +173,13 @@ struct udev_monitor *udev_monitor_new_from_netlink(
 int udev_monitor_filter_add_match_subsystem_devtype(
     struct udev_monitor *udev_monitor, char const *subsystem,
     char const *devtype);
+
+/* Only events of devices carrying the tag are received.  Must be called
+ * before udev_monitor_enable_receiving(). */
+int udev_monitor_filter_add_match_tag(
+    struct udev_monitor *udev_monitor, char const *tag);
+/* Does nothing and returns 0 if the monitor is already receiving, as after
+ * udev_enumerate_scan_devices_with_monitor(). */
 int udev_monitor_enable_receiving(struct udev_monitor *udev_monitor);
 int udev_monitor_get_fd(struct udev_monitor *udev_monitor);
 struct udev *udev_monitor_get_udev(struct udev_monitor *udev_monitor);
@@ -0,0 +1,709 @@
+#ifndef LIBUDEV_FBSD_HPP_
+#define LIBUDEV_FBSD_HPP_
+
+/*
+ * C++17 interface to libudev.h.
+ *
+ * Handles are move-only and own exactly one reference, so passing them
+ * around never touches a refcount.  Objects the C layer lends out, like a
+ * device's parent or list entries, are exposed as views that are valid as
+ * long as their owner.  Strings are returned as std::string_view into the
+ * library's storage; a missing value is a view with a null data().  Nothing
+ * here allocates beyond what the C calls do, and nothing throws: failed
+ * constructions and lookups yield empty handles that test false.  An empty
+ * device or list entry answers every accessor with an empty view, 0 or
+ * false instead of passing null to the C layer.
+ */
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <string_view>
+#include <utility>
+
+#include "libudev.h"
+
+namespace libudev {
+
+namespace detail {
+
+inline std::string_view
+view(char const *s) noexcept
+{
+	return s ? std::string_view(s) : std::string_view();
+}
+
+/* The C API wants NUL-terminated strings; sysnames and keys are short. */
+template <std::size_t N> class c_string {
+    public:
+	explicit c_string(std::string_view s) noexcept
+	    : ok_(s.size() < N)
+	{
+		if (ok_) {
+			std::memcpy(buf_, s.data(), s.size());
+			buf_[s.size()] = '\0';
+		}
+	}
+
+	char const *
+	get() const noexcept
+	{
+		return ok_ ? buf_ : nullptr;
+	}
+
+    private:
+	char buf_[N];
+	bool ok_;
+};
+
+template <typename T, void (*Unref)(T *)> class handle {
+    public:
+	handle() noexcept = default;
+	explicit handle(T *ptr) noexcept
+	    : ptr_(ptr)
+	{
+	}
+	handle(handle const &) = delete;
+	handle &operator=(handle const &) = delete;
+	handle(handle &&other) noexcept
+	    : ptr_(std::exchange(other.ptr_, nullptr))
+	{
+	}
+	handle &
+	operator=(handle &&other) noexcept
+	{
+		if (this != &other) {
+			reset(std::exchange(other.ptr_, nullptr));
+		}
+		return *this;
+	}
+	~handle()
+	{
+		reset();
+	}
+
+	void
+	reset(T *ptr = nullptr) noexcept
+	{
+		if (ptr_) {
+			Unref(ptr_);
+		}
+		ptr_ = ptr;
+	}
+
+	/* Gives up ownership of the reference. */
+	T *
+	release() noexcept
+	{
+		return std::exchange(ptr_, nullptr);
+	}
+
+	T *
+	get() const noexcept
+	{
+		return ptr_;
+	}
+
+	explicit operator bool() const noexcept
+	{
+		return ptr_ != nullptr;
+	}
+
+    protected:
+	T *ptr_ = nullptr;
+};
+
+} // namespace detail
+
+/* The classification properties set on every probed input device. */
+enum class input_class {
+	input,
+	touchpad,
+	mouse,
+	keyboard,
+	joystick,
+};
+
+constexpr char const *
+property_key(input_class c) noexcept
+{
+	switch (c) {
+	case input_class::input:
+		return "ID_INPUT";
+	case input_class::touchpad:
+		return "ID_INPUT_TOUCHPAD";
+	case input_class::mouse:
+		return "ID_INPUT_MOUSE";
+	case input_class::keyboard:
+		return "ID_INPUT_KEYBOARD";
+	case input_class::joystick:
+		return "ID_INPUT_JOYSTICK";
+	}
+	return nullptr;
+}
+
+class list_entry {
+    public:
+	explicit list_entry(struct udev_list_entry *entry) noexcept
+	    : entry_(entry)
+	{
+	}
+
+	explicit operator bool() const noexcept
+	{
+		return entry_ != nullptr;
+	}
+
+	std::string_view
+	name() const noexcept
+	{
+		return detail::view(
+		    entry_ ? udev_list_entry_get_name(entry_) : nullptr);
+	}
+
+	std::string_view
+	value() const noexcept
+	{
+		return detail::view(
+		    entry_ ? udev_list_entry_get_value(entry_) : nullptr);
+	}
+
+	struct udev_list_entry *
+	get() const noexcept
+	{
+		return entry_;
+	}
+
+    private:
+	struct udev_list_entry *entry_;
+};
+
+/* A range over a list owned by a device or an enumerate. */
+class list_range {
+    public:
+	class iterator {
+	    public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = list_entry;
+		using difference_type = std::ptrdiff_t;
+		using pointer = void;
+		using reference = list_entry;
+
+		explicit iterator(struct udev_list_entry *entry) noexcept
+		    : entry_(entry)
+		{
+		}
+
+		list_entry
+		operator*() const noexcept
+		{
+			return list_entry(entry_);
+		}
+
+		iterator &
+		operator++() noexcept
+		{
+			entry_ = udev_list_entry_get_next(entry_);
+			return *this;
+		}
+
+		iterator
+		operator++(int) noexcept
+		{
+			iterator old = *this;
+			++*this;
+			return old;
+		}
+
+		bool
+		operator==(iterator const &other) const noexcept
+		{
+			return entry_ == other.entry_;
+		}
+
+		bool
+		operator!=(iterator const &other) const noexcept
+		{
+			return entry_ != other.entry_;
+		}
+
+	    private:
+		struct udev_list_entry *entry_;
+	};
+
+	explicit list_range(struct udev_list_entry *first) noexcept
+	    : first_(first)
+	{
+	}
+
+	iterator
+	begin() const noexcept
+	{
+		return iterator(first_);
+	}
+
+	iterator
+	end() const noexcept
+	{
+		return iterator(nullptr);
+	}
+
+	bool
+	empty() const noexcept
+	{
+		return first_ == nullptr;
+	}
+
+    private:
+	struct udev_list_entry *first_;
+};
+
+/* Non-owning access to a device, e.g. a parent owned by its child. */
+class device_view {
+    public:
+	explicit device_view(struct udev_device *dev) noexcept
+	    : dev_(dev)
+	{
+	}
+
+	explicit operator bool() const noexcept
+	{
+		return dev_ != nullptr;
+	}
+
+	struct udev_device *
+	get() const noexcept
+	{
+		return dev_;
+	}
+
+	std::string_view
+	syspath() const noexcept
+	{
+		return detail::view(
+		    dev_ ? udev_device_get_syspath(dev_) : nullptr);
+	}
+
+	std::string_view
+	sysname() const noexcept
+	{
+		return detail::view(
+		    dev_ ? udev_device_get_sysname(dev_) : nullptr);
+	}
+
+	std::string_view
+	devnode() const noexcept
+	{
+		return detail::view(
+		    dev_ ? udev_device_get_devnode(dev_) : nullptr);
+	}
+
+	dev_t
+	devnum() const noexcept
+	{
+		return dev_ ? udev_device_get_devnum(dev_) : 0;
+	}
+
+	std::string_view
+	subsystem() const noexcept
+	{
+		return detail::view(
+		    dev_ ? udev_device_get_subsystem(dev_) : nullptr);
+	}
+
+	std::string_view
+	devtype() const noexcept
+	{
+		return detail::view(
+		    dev_ ? udev_device_get_devtype(dev_) : nullptr);
+	}
+
+	std::string_view
+	action() const noexcept
+	{
+		return detail::view(
+		    dev_ ? udev_device_get_action(dev_) : nullptr);
+	}
+
+	unsigned long long
+	seqnum() const noexcept
+	{
+		return dev_ ? udev_device_get_seqnum(dev_) : 0;
+	}
+
+	unsigned long long
+	usec_since_initialized() const noexcept
+	{
+		return dev_ ? udev_device_get_usec_since_initialized(dev_)
+			    : 0;
+	}
+
+	bool
+	is_initialized() const noexcept
+	{
+		return dev_ && udev_device_get_is_initialized(dev_) != 0;
+	}
+
+	std::string_view
+	property(char const *key) const noexcept
+	{
+		return detail::view(
+		    dev_ ? udev_device_get_property_value(dev_, key)
+			 : nullptr);
+	}
+
+	bool
+	has(input_class c) const noexcept
+	{
+		return dev_ &&
+		    udev_device_get_property_value(dev_, property_key(c)) !=
+			nullptr;
+	}
+
+	bool
+	has_tag(char const *tag) const noexcept
+	{
+		return dev_ && udev_device_has_tag(dev_, tag) != 0;
+	}
+
+	std::string_view
+	sysattr(char const *name) const noexcept
+	{
+		return detail::view(
+		    dev_ ? udev_device_get_sysattr_value(dev_, name)
+			 : nullptr);
+	}
+
+	list_range
+	properties() const noexcept
+	{
+		return list_range(dev_
+			? udev_device_get_properties_list_entry(dev_)
+			: nullptr);
+	}
+
+	device_view
+	parent() const noexcept
+	{
+		return device_view(
+		    dev_ ? udev_device_get_parent(dev_) : nullptr);
+	}
+
+	device_view
+	parent(char const *subsystem, char const *devtype = nullptr) const
+	    noexcept
+	{
+		return device_view(dev_
+			? udev_device_get_parent_with_subsystem_devtype(
+			      dev_, subsystem, devtype)
+			: nullptr);
+	}
+
+	/* See udev_device_serialize(). */
+	ssize_t
+	serialize(void *buf, std::size_t size) const noexcept
+	{
+		if (!dev_) {
+			errno = EINVAL;
+			return -1;
+		}
+		return udev_device_serialize(dev_, buf, size);
+	}
+
+	/* See udev_device_take_fd(); the caller owns the result. */
+	int
+	take_fd() const noexcept
+	{
+		return dev_ ? udev_device_take_fd(dev_) : -1;
+	}
+
+    protected:
+	struct udev_device *dev_;
+};
+
+/*
+ * An owned device.  The view is a private base, so a device never converts
+ * to a device_view that could outlive it; view() makes the borrow explicit.
+ */
+class device : private device_view {
+    public:
+	using device_view::operator bool;
+	using device_view::get;
+	using device_view::syspath;
+	using device_view::sysname;
+	using device_view::devnode;
+	using device_view::devnum;
+	using device_view::subsystem;
+	using device_view::devtype;
+	using device_view::action;
+	using device_view::seqnum;
+	using device_view::usec_since_initialized;
+	using device_view::is_initialized;
+	using device_view::property;
+	using device_view::has;
+	using device_view::has_tag;
+	using device_view::sysattr;
+	using device_view::properties;
+	using device_view::parent;
+	using device_view::serialize;
+	using device_view::take_fd;
+
+	device() noexcept
+	    : device_view(nullptr)
+	{
+	}
+
+	/* Adopts a reference, e.g. from udev_monitor_receive_device(). */
+	explicit device(struct udev_device *dev) noexcept
+	    : device_view(dev)
+	{
+	}
+
+	device(device const &) = delete;
+	device &operator=(device const &) = delete;
+
+	device(device &&other) noexcept
+	    : device_view(std::exchange(other.dev_, nullptr))
+	{
+	}
+
+	device &
+	operator=(device &&other) noexcept
+	{
+		if (this != &other) {
+			reset(std::exchange(other.dev_, nullptr));
+		}
+		return *this;
+	}
+
+	~device()
+	{
+		reset();
+	}
+
+	/* Valid as long as this device holds its reference. */
+	device_view
+	view() const noexcept
+	{
+		return device_view(dev_);
+	}
+
+	void
+	reset(struct udev_device *dev = nullptr) noexcept
+	{
+		if (dev_) {
+			udev_device_unref(dev_);
+		}
+		dev_ = dev;
+	}
+
+	struct udev_device *
+	release() noexcept
+	{
+		return std::exchange(dev_, nullptr);
+	}
+
+	/* Takes a new reference on a borrowed device. */
+	static device
+	ref(device_view view) noexcept
+	{
+		return device(view ? udev_device_ref(view.get()) : nullptr);
+	}
+};
+
+class context : public detail::handle<struct udev, udev_unref> {
+    public:
+	using handle::handle;
+
+	static context
+	create() noexcept
+	{
+		return context(udev_new());
+	}
+
+	bool
+	enable_live_enumeration() noexcept
+	{
+		return udev_enable_live_enumeration(ptr_) >= 0;
+	}
+
+	bool
+	enable_fd_handoff(unsigned max_fds, unsigned idle_timeout_ms) noexcept
+	{
+		return udev_enable_fd_handoff(
+			   ptr_, max_fds, idle_timeout_ms) >= 0;
+	}
+
+	device
+	device_from_syspath(char const *syspath) const noexcept
+	{
+		return device(udev_device_new_from_syspath(ptr_, syspath));
+	}
+
+	device
+	device_from_devnum(char type, dev_t devnum) const noexcept
+	{
+		return device(udev_device_new_from_devnum(ptr_, type, devnum));
+	}
+
+	/* The buffer must outlive the device, see
+	 * udev_device_new_from_buffer(). */
+	device
+	device_from_buffer(void const *buf, std::size_t size,
+	    std::size_t *used = nullptr) const noexcept
+	{
+		return device(
+		    udev_device_new_from_buffer(ptr_, buf, size, used));
+	}
+};
+
+class monitor : public detail::handle<struct udev_monitor, udev_monitor_unref>
+{
+    public:
+	using handle::handle;
+
+	static monitor
+	create(context const &ctx, char const *name = "udev") noexcept
+	{
+		return monitor(udev_monitor_new_from_netlink(ctx.get(), name));
+	}
+
+	bool
+	add_match(
+	    char const *subsystem, char const *devtype = nullptr) noexcept
+	{
+		return udev_monitor_filter_add_match_subsystem_devtype(
+			   ptr_, subsystem, devtype) >= 0;
+	}
+
+	bool
+	add_match_tag(char const *tag) noexcept
+	{
+		return udev_monitor_filter_add_match_tag(ptr_, tag) >= 0;
+	}
+
+	/* A no-op after enumerate::scan_with_monitor(). */
+	bool
+	enable() noexcept
+	{
+		return udev_monitor_enable_receiving(ptr_) >= 0;
+	}
+
+	int
+	fd() const noexcept
+	{
+		return udev_monitor_get_fd(ptr_);
+	}
+
+	/* Returns an empty device if no event is pending. */
+	device
+	receive() noexcept
+	{
+		return device(udev_monitor_receive_device(ptr_));
+	}
+};
+
+class enumerate
+    : public detail::handle<struct udev_enumerate, udev_enumerate_unref> {
+    public:
+	using handle::handle;
+
+	static enumerate
+	create(context const &ctx) noexcept
+	{
+		return enumerate(udev_enumerate_new(ctx.get()));
+	}
+
+	bool
+	add_match_subsystem(char const *subsystem) noexcept
+	{
+		return udev_enumerate_add_match_subsystem(
+			   ptr_, subsystem) >= 0;
+	}
+
+	bool
+	add_match_sysname(char const *sysname) noexcept
+	{
+		return udev_enumerate_add_match_sysname(ptr_, sysname) >= 0;
+	}
+
+	bool
+	add_match_property(char const *key, char const *value) noexcept
+	{
+		return udev_enumerate_add_match_property(
+			   ptr_, key, value) >= 0;
+	}
+
+	bool
+	add_match_tag(char const *tag) noexcept
+	{
+		return udev_enumerate_add_match_tag(ptr_, tag) >= 0;
+	}
+
+	bool
+	scan() noexcept
+	{
+		return udev_enumerate_scan_devices(ptr_) >= 0;
+	}
+
+	/* Also enables mon; there is no need to call mon.enable(). */
+	bool
+	scan_with_monitor(monitor &mon) noexcept
+	{
+		return udev_enumerate_scan_devices_with_monitor(
+			   ptr_, mon.get()) >= 0;
+	}
+
+	list_range
+	entries() const noexcept
+	{
+		return list_range(udev_enumerate_get_list_entry(ptr_));
+	}
+
+	list_range::iterator
+	begin() const noexcept
+	{
+		return entries().begin();
+	}
+
+	list_range::iterator
+	end() const noexcept
+	{
+		return entries().end();
+	}
+
+	std::size_t
+	size() const noexcept
+	{
+		return udev_enumerate_get_count(ptr_);
+	}
+
+	/* See udev_enumerate_serialize(). */
+	ssize_t
+	serialize(void *buf, std::size_t size) noexcept
+	{
+		return udev_enumerate_serialize(ptr_, buf, size);
+	}
+
+	list_entry
+	operator[](std::size_t index) const noexcept
+	{
+		return list_entry(
+		    ptr_ ? udev_enumerate_get_entry(ptr_, index) : nullptr);
+	}
+
+	/* The entry tests false if there is no such device. */
+	list_entry
+	find(std::string_view sysname) const noexcept
+	{
+		detail::c_string<64> name(sysname);
+		return list_entry(ptr_ && name.get()
+			? udev_enumerate_find_sysname(ptr_, name.get())
+			: nullptr);
+	}
+};
+
+} // namespace libudev
+
+#endif
@@ -0,0 +1,547 @@
+/*
+ * udev-replay: re-runs a call trace against the library and times it.
+ *
+ * Reads a trace recorded with LIBUDEV_TRACE (see trace.h), issues the same
+ * calls in the same order and reports, per function, the number of calls
+ * and the time they took when recorded and when replayed.  Objects are
+ * mapped from the recorded addresses to the ones returned during the
+ * replay, so a consumer's pattern of creating devices, walking parents and
+ * querying properties is reproduced call for call.
+ *
+ * The replay runs against the device nodes of the host it runs on.  Calls
+ * whose result differs in kind from the recording (a device that is not
+ * found, a property that is missing) are counted as mismatches.  Calls on
+ * objects the replay never got are skipped, as are devices wrapped from
+ * buffers, whose contents the trace does not hold.
+ */
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include "libudev.h"
+#include "trace.h"
+
+static char const *const call_names[] = {
+#define TRACE_NAME(name) #name,
+    TRACE_CALLS(TRACE_NAME)
+#undef TRACE_NAME
+};
+
+struct call_stats {
+	unsigned call;
+	uint64_t count;
+	uint64_t recorded_nsec;
+	uint64_t replayed_nsec;
+};
+
+/* Recorded object addresses to replayed ones, open addressing. */
+struct object_map {
+	struct object_slot {
+		uint64_t recorded;
+		void *replayed;
+	} *slots;
+	size_t capacity;
+	size_t count;
+};
+
+struct replay {
+	struct object_map map;
+	struct call_stats stats[TRACE_CALL_COUNT];
+	uint64_t mismatches;
+	uint64_t skipped;
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static struct object_slot *
+map_slot(struct object_map *map, uint64_t recorded)
+{
+	size_t mask = map->capacity - 1;
+	size_t i = (size_t)((recorded >> 4) * 0x9e3779b97f4a7c15u) & mask;
+
+	while (map->slots[i].recorded && map->slots[i].recorded != recorded) {
+		i = (i + 1) & mask;
+	}
+	return &map->slots[i];
+}
+
+static void
+map_put(struct object_map *map, uint64_t recorded, void *replayed)
+{
+	if (!recorded) {
+		return;
+	}
+
+	if (2 * (map->count + 1) > map->capacity) {
+		struct object_map grown = {
+		    calloc(map->capacity ? 2 * map->capacity : 256,
+			sizeof(struct object_slot)),
+		    map->capacity ? 2 * map->capacity : 256, 0};
+		if (!grown.slots) {
+			perror("calloc");
+			exit(1);
+		}
+		for (size_t i = 0; i < map->capacity; ++i) {
+			if (map->slots[i].recorded) {
+				*map_slot(&grown, map->slots[i].recorded) =
+				    map->slots[i];
+				++grown.count;
+			}
+		}
+		free(map->slots);
+		*map = grown;
+	}
+
+	/* Also stores failures, so a reused address never maps to an object
+	 * that was already released. */
+	struct object_slot *slot = map_slot(map, recorded);
+	if (!slot->recorded) {
+		++map->count;
+	}
+	*slot = (struct object_slot){recorded, replayed};
+}
+
+static void *
+map_get(struct object_map *map, uint64_t recorded)
+{
+	if (!recorded || !map->capacity) {
+		return NULL;
+	}
+	return map_slot(map, recorded)->replayed;
+}
+
+/* Descriptors only need to agree on success. */
+static uint64_t
+same_sign(uint64_t fd, uint64_t recorded)
+{
+	return ((int)fd < 0) == ((int)recorded < 0) ? recorded : fd;
+}
+
+/* Issues one recorded call; returns false if it had to be skipped. */
+static bool
+replay_call(struct replay *r, struct trace_record const *rec,
+    char const *const *strings)
+{
+	void *obj = map_get(&r->map, rec->object);
+	void *arg_obj = map_get(&r->map, rec->arg);
+	uint64_t result = 0;
+	void *result_obj = NULL;
+	bool is_object = false;
+	uint64_t start = 0, end = 0;
+
+	if (rec->call != TRACE_udev_new && !obj) {
+		return false;
+	}
+
+/* Times expr and keeps its result for comparison with the recording. */
+#define RUN_VALUE(expr)                                                       \
+	do {                                                                  \
+		start = now_ns();                                             \
+		result = (uint64_t)(expr);                                    \
+		end = now_ns();                                               \
+	} while (0)
+#define RUN_STRING(expr)                                                      \
+	do {                                                                  \
+		start = now_ns();                                             \
+		result = (expr) != NULL;                                      \
+		end = now_ns();                                               \
+	} while (0)
+#define RUN_OBJECT(expr)                                                      \
+	do {                                                                  \
+		start = now_ns();                                             \
+		result_obj = (expr);                                          \
+		end = now_ns();                                               \
+		result = (uintptr_t)result_obj;                               \
+		is_object = true;                                             \
+	} while (0)
+#define RUN_VOID(expr)                                                        \
+	do {                                                                  \
+		start = now_ns();                                             \
+		expr;                                                         \
+		end = now_ns();                                               \
+		result = rec->result;                                         \
+	} while (0)
+
+	switch ((enum trace_call)rec->call) {
+	case TRACE_udev_new:
+		RUN_OBJECT(udev_new());
+		break;
+	case TRACE_udev_ref:
+		RUN_OBJECT(udev_ref(obj));
+		break;
+	case TRACE_udev_unref:
+		RUN_VOID(udev_unref(obj));
+		break;
+	case TRACE_udev_enable_live_enumeration:
+		RUN_VALUE(udev_enable_live_enumeration(obj));
+		break;
+	case TRACE_udev_enable_fd_handoff:
+		RUN_VALUE(udev_enable_fd_handoff(
+		    obj, (unsigned)(rec->arg >> 32), (unsigned)rec->arg));
+		break;
+	case TRACE_udev_device_get_devnode:
+		RUN_STRING(udev_device_get_devnode(obj));
+		break;
+	case TRACE_udev_device_get_devnum:
+		RUN_VALUE(udev_device_get_devnum(obj));
+		break;
+	case TRACE_udev_device_get_property_value:
+		RUN_STRING(udev_device_get_property_value(obj, strings[0]));
+		break;
+	case TRACE_udev_device_get_udev:
+		RUN_OBJECT(udev_device_get_udev(obj));
+		break;
+	case TRACE_udev_device_new_from_syspath:
+		RUN_OBJECT(udev_device_new_from_syspath(obj, strings[0]));
+		break;
+	case TRACE_udev_device_new_from_devnum:
+		RUN_OBJECT(udev_device_new_from_devnum(
+		    obj, strings[0] ? strings[0][0] : 'c', (dev_t)rec->arg));
+		break;
+	case TRACE_udev_device_get_syspath:
+		RUN_STRING(udev_device_get_syspath(obj));
+		break;
+	case TRACE_udev_device_get_sysname:
+		RUN_STRING(udev_device_get_sysname(obj));
+		break;
+	case TRACE_udev_device_get_subsystem:
+		RUN_STRING(udev_device_get_subsystem(obj));
+		break;
+	case TRACE_udev_device_get_devtype:
+		RUN_STRING(udev_device_get_devtype(obj));
+		break;
+	case TRACE_udev_device_get_sysattr_value:
+		RUN_STRING(udev_device_get_sysattr_value(obj, strings[0]));
+		break;
+	case TRACE_udev_device_get_properties_list_entry:
+		RUN_OBJECT(udev_device_get_properties_list_entry(obj));
+		break;
+	case TRACE_udev_device_ref:
+		RUN_OBJECT(udev_device_ref(obj));
+		break;
+	case TRACE_udev_device_unref:
+		RUN_VOID(udev_device_unref(obj));
+		break;
+	case TRACE_udev_device_get_parent:
+		RUN_OBJECT(udev_device_get_parent(obj));
+		break;
+	case TRACE_udev_device_get_is_initialized:
+		RUN_VALUE(udev_device_get_is_initialized(obj));
+		break;
+	case TRACE_udev_device_get_action:
+		RUN_STRING(udev_device_get_action(obj));
+		break;
+	case TRACE_udev_device_get_seqnum:
+		RUN_VALUE(udev_device_get_seqnum(obj));
+		result = rec->result;
+		break;
+	case TRACE_udev_device_take_fd:
+		RUN_VALUE(udev_device_take_fd(obj));
+		if ((int)result >= 0) {
+			close((int)result);
+		}
+		result = same_sign(result, rec->result);
+		break;
+	case TRACE_udev_device_get_usec_since_initialized:
+		RUN_VALUE(udev_device_get_usec_since_initialized(obj));
+		result = rec->result;
+		break;
+	case TRACE_udev_device_get_parent_with_subsystem_devtype:
+		RUN_OBJECT(udev_device_get_parent_with_subsystem_devtype(
+		    obj, strings[0], strings[1]));
+		break;
+	case TRACE_udev_enumerate_new:
+		RUN_OBJECT(udev_enumerate_new(obj));
+		break;
+	case TRACE_udev_enumerate_add_match_subsystem:
+		RUN_VALUE(udev_enumerate_add_match_subsystem(obj, strings[0]));
+		break;
+	case TRACE_udev_enumerate_scan_devices:
+		RUN_VALUE(udev_enumerate_scan_devices(obj));
+		break;
+	case TRACE_udev_enumerate_get_list_entry:
+		RUN_OBJECT(udev_enumerate_get_list_entry(obj));
+		break;
+	case TRACE_udev_enumerate_add_match_sysname:
+		RUN_VALUE(udev_enumerate_add_match_sysname(obj, strings[0]));
+		break;
+	case TRACE_udev_enumerate_add_match_property:
+		RUN_VALUE(udev_enumerate_add_match_property(
+		    obj, strings[0], strings[1]));
+		break;
+	case TRACE_udev_enumerate_unref:
+		RUN_VOID(udev_enumerate_unref(obj));
+		break;
+	case TRACE_udev_enumerate_get_count:
+		RUN_VALUE(udev_enumerate_get_count(obj));
+		break;
+	case TRACE_udev_enumerate_get_entry:
+		RUN_OBJECT(udev_enumerate_get_entry(obj, (size_t)rec->arg));
+		break;
+	case TRACE_udev_enumerate_find_sysname:
+		RUN_OBJECT(udev_enumerate_find_sysname(obj, strings[0]));
+		break;
+	case TRACE_udev_enumerate_scan_devices_with_monitor:
+		if (!arg_obj) {
+			return false;
+		}
+		RUN_VALUE(
+		    udev_enumerate_scan_devices_with_monitor(obj, arg_obj));
+		break;
+	case TRACE_udev_list_entry_get_name:
+		RUN_STRING(udev_list_entry_get_name(obj));
+		break;
+	case TRACE_udev_list_entry_get_value:
+		RUN_STRING(udev_list_entry_get_value(obj));
+		break;
+	case TRACE_udev_list_entry_get_next:
+		RUN_OBJECT(udev_list_entry_get_next(obj));
+		break;
+	case TRACE_udev_monitor_new_from_netlink:
+		RUN_OBJECT(udev_monitor_new_from_netlink(obj, strings[0]));
+		break;
+	case TRACE_udev_monitor_filter_add_match_subsystem_devtype:
+		RUN_VALUE(udev_monitor_filter_add_match_subsystem_devtype(
+		    obj, strings[0], strings[1]));
+		break;
+	case TRACE_udev_monitor_enable_receiving:
+		RUN_VALUE(udev_monitor_enable_receiving(obj));
+		break;
+	case TRACE_udev_monitor_get_fd:
+		RUN_VALUE(udev_monitor_get_fd(obj));
+		result = same_sign(result, rec->result);
+		break;
+	case TRACE_udev_monitor_get_udev:
+		RUN_OBJECT(udev_monitor_get_udev(obj));
+		break;
+	case TRACE_udev_monitor_receive_device:
+		RUN_OBJECT(udev_monitor_receive_device(obj));
+		break;
+	case TRACE_udev_monitor_unref:
+		RUN_VOID(udev_monitor_unref(obj));
+		break;
+	case TRACE_udev_device_serialize:
+	case TRACE_udev_enumerate_serialize: {
+		void *buf = rec->arg ? malloc(rec->arg) : NULL;
+		if (rec->arg && !buf) {
+			return false;
+		}
+		if (rec->call == TRACE_udev_device_serialize) {
+			RUN_VALUE(udev_device_serialize(obj, buf, rec->arg));
+		} else {
+			RUN_VALUE(
+			    udev_enumerate_serialize(obj, buf, rec->arg));
+		}
+		free(buf);
+		break;
+	}
+	case TRACE_udev_device_new_from_buffer:
+		/* The buffer's contents are not part of the trace. */
+		return false;
+	case TRACE_udev_device_has_tag:
+		RUN_VALUE(udev_device_has_tag(obj, strings[0]));
+		break;
+	case TRACE_udev_enumerate_add_match_tag:
+		RUN_VALUE(udev_enumerate_add_match_tag(obj, strings[0]));
+		break;
+	case TRACE_udev_monitor_filter_add_match_tag:
+		RUN_VALUE(udev_monitor_filter_add_match_tag(obj, strings[0]));
+		break;
+	case TRACE_CALL_COUNT:
+		return false;
+	}
+
+#undef RUN_VALUE
+#undef RUN_STRING
+#undef RUN_OBJECT
+#undef RUN_VOID
+
+	if (is_object) {
+		map_put(&r->map, rec->result, result_obj);
+		if ((rec->result != 0) != (result_obj != NULL)) {
+			++r->mismatches;
+		}
+	} else if (result != rec->result) {
+		++r->mismatches;
+	}
+
+	struct call_stats *s = &r->stats[rec->call];
+	++s->count;
+	s->recorded_nsec += rec->nsec;
+	s->replayed_nsec += end - start;
+	return true;
+}
+
+static int
+replay_trace(struct replay *r, char const *buf, size_t size)
+{
+	size_t off = sizeof(struct trace_header);
+
+	while (off + sizeof(struct trace_record) <= size) {
+		struct trace_record rec;
+		memcpy(&rec, buf + off, sizeof(rec));
+		off += sizeof(rec);
+
+		if (rec.call >= TRACE_CALL_COUNT ||
+		    rec.strings_size > size - off ||
+		    (rec.strings_size && buf[off + rec.strings_size - 1])) {
+			fprintf(stderr, "udev-replay: corrupt record at %zu\n",
+			    off - sizeof(rec));
+			return -1;
+		}
+
+		char const *strings[2] = {NULL, NULL};
+		char const *s = buf + off;
+		for (unsigned i = 0; i < 2 && s < buf + off + rec.strings_size;
+		     ++i) {
+			strings[i] = rec.null_strings & (1u << i) ? NULL : s;
+			s += strlen(s) + 1;
+		}
+		off += rec.strings_size;
+
+		if (!replay_call(r, &rec, strings)) {
+			++r->skipped;
+		}
+	}
+
+	return 0;
+}
+
+static int
+compare_stats(void const *a, void const *b)
+{
+	uint64_t ta = ((struct call_stats const *)a)->replayed_nsec;
+	uint64_t tb = ((struct call_stats const *)b)->replayed_nsec;
+	return (ta < tb) - (ta > tb);
+}
+
+static void
+report(struct replay *r, unsigned iterations)
+{
+	uint64_t count = 0, recorded = 0, replayed = 0;
+
+	for (unsigned i = 0; i < TRACE_CALL_COUNT; ++i) {
+		r->stats[i].call = i;
+		count += r->stats[i].count;
+		recorded += r->stats[i].recorded_nsec;
+		replayed += r->stats[i].replayed_nsec;
+	}
+	qsort(r->stats, TRACE_CALL_COUNT, sizeof(r->stats[0]), compare_stats);
+
+	printf("%-48s %9s %12s %12s %9s\n", "call", "count", "recorded_us",
+	    "replayed_us", "mean_ns");
+	for (unsigned i = 0; i < TRACE_CALL_COUNT; ++i) {
+		struct call_stats const *s = &r->stats[i];
+		if (!s->count) {
+			continue;
+		}
+		printf("%-48s %9" PRIu64 " %12.1f %12.1f %9" PRIu64 "\n",
+		    call_names[s->call], s->count / iterations,
+		    s->recorded_nsec / iterations / 1e3,
+		    s->replayed_nsec / iterations / 1e3,
+		    s->replayed_nsec / s->count);
+	}
+	printf("%-48s %9" PRIu64 " %12.1f %12.1f\n", "total",
+	    count / iterations, recorded / iterations / 1e3,
+	    replayed / iterations / 1e3);
+
+	if (r->mismatches || r->skipped) {
+		printf("%" PRIu64 " calls with a different result, "
+		       "%" PRIu64 " skipped\n",
+		    r->mismatches / iterations, r->skipped / iterations);
+	}
+}
+
+static void
+usage(char const *argv0)
+{
+	fprintf(stderr,
+	    "usage: %s [-n iterations] trace\n"
+	    "  -n  replay the trace this many times (default 1)\n",
+	    argv0);
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned iterations = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = (unsigned)strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind + 1 != argc || iterations == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	FILE *f = fopen(argv[optind], "re");
+	if (!f) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	char *buf = NULL;
+	size_t size = 0, cap = 0, n;
+	do {
+		if (size == cap) {
+			cap = cap ? 2 * cap : 65536;
+			buf = realloc(buf, cap);
+			if (!buf) {
+				perror("realloc");
+				return 1;
+			}
+		}
+		n = fread(buf + size, 1, cap - size, f);
+		size += n;
+	} while (n > 0);
+	fclose(f);
+
+	struct trace_header hdr;
+	if (size < sizeof(hdr) ||
+	    (memcpy(&hdr, buf, sizeof(hdr)),
+		memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0) ||
+	    hdr.version != TRACE_VERSION) {
+		fprintf(stderr, "%s: not a trace of this version\n",
+		    argv[optind]);
+		return 1;
+	}
+
+	struct replay r = {0};
+	for (unsigned i = 0; i < iterations; ++i) {
+		/* Each pass starts over, as a fresh consumer would. */
+		free(r.map.slots);
+		r.map = (struct object_map){0};
+		if (replay_trace(&r, buf, size) < 0) {
+			return 1;
+		}
+	}
+
+	report(&r, iterations);
+
+	free(r.map.slots);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,659 @@
+/*
+ * Call recorder for traced builds, see trace.h.
+ *
+ * Every public function is wrapped here around its untraced counterpart in
+ * libudev.c.  Calls made by the library itself do not pass through the
+ * wrappers, so a trace holds exactly what the consumer asked for.  With
+ * LIBUDEV_TRACE unset, a wrapper costs a pthread_once() check.
+ */
+#define _GNU_SOURCE
+
+#include "trace.h"
+
+#include "libudev.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_file;
+
+static void
+trace_open(void)
+{
+	char const *path = getenv(TRACE_ENV);
+	if (!path || !*path) {
+		return;
+	}
+
+	FILE *f = fopen(path, "we");
+	if (!f) {
+		return;
+	}
+
+	struct trace_header hdr = {TRACE_MAGIC, TRACE_VERSION, 0};
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1) {
+		fclose(f);
+		return;
+	}
+
+	/* Left open; exit(3) flushes it. */
+	trace_file = f;
+}
+
+static uint64_t
+trace_now(void)
+{
+	pthread_once(&trace_once, trace_open);
+	if (!trace_file) {
+		return 0;
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void
+trace_write(enum trace_call call, uint64_t start, void const *object,
+    uint64_t arg, uint64_t result, char const *const *strings,
+    unsigned string_count)
+{
+	uint64_t nsec = trace_now() - start;
+	struct trace_record rec = {
+	    .call = (uint8_t)call,
+	    .nsec = nsec > UINT32_MAX ? UINT32_MAX : (uint32_t)nsec,
+	    .object = (uintptr_t)object,
+	    .arg = arg,
+	    .result = result,
+	};
+
+	size_t size = 0;
+	for (unsigned i = 0; i < string_count; ++i) {
+		if (!strings[i]) {
+			rec.null_strings |= (uint8_t)(1u << i);
+		}
+		size += (strings[i] ? strlen(strings[i]) : 0) + 1;
+	}
+	if (size > UINT16_MAX) {
+		return;
+	}
+	rec.strings_size = (uint16_t)size;
+
+	pthread_mutex_lock(&trace_lock);
+	fwrite(&rec, sizeof(rec), 1, trace_file);
+	for (unsigned i = 0; i < string_count; ++i) {
+		char const *s = strings[i] ? strings[i] : "";
+		fwrite(s, strlen(s) + 1, 1, trace_file);
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static uint64_t
+trace_object(void const *object)
+{
+	return (uintptr_t)object;
+}
+
+static uint64_t
+trace_string(char const *s)
+{
+	return s != NULL;
+}
+
+#define TRACE_BEGIN uint64_t trace_start = trace_now()
+
+#define TRACE_END(name, object, arg, result, ...)                             \
+	do {                                                                  \
+		if (trace_start) {                                            \
+			char const *strings[] = {NULL, __VA_ARGS__};          \
+			trace_write(TRACE_##name, trace_start, object, arg,   \
+			    result, strings + 1,                              \
+			    sizeof(strings) / sizeof(strings[0]) - 1);        \
+		}                                                             \
+	} while (0)
+
+struct udev *
+(udev_new)(void)
+{
+	TRACE_BEGIN;
+	struct udev *ret = udev_new();
+	TRACE_END(udev_new, NULL, 0, trace_object(ret));
+	return ret;
+}
+
+struct udev *
+(udev_ref)(struct udev *udev)
+{
+	TRACE_BEGIN;
+	struct udev *ret = udev_ref(udev);
+	TRACE_END(udev_ref, udev, 0, trace_object(ret));
+	return ret;
+}
+
+void
+(udev_unref)(struct udev *udev)
+{
+	TRACE_BEGIN;
+	udev_unref(udev);
+	TRACE_END(udev_unref, udev, 0, 0);
+}
+
+int
+(udev_enable_live_enumeration)(struct udev *udev)
+{
+	TRACE_BEGIN;
+	int ret = udev_enable_live_enumeration(udev);
+	TRACE_END(udev_enable_live_enumeration, udev, 0, (uint64_t)ret);
+	return ret;
+}
+
+int
+(udev_enable_fd_handoff)(
+    struct udev *udev, unsigned max_fds, unsigned idle_timeout_ms)
+{
+	TRACE_BEGIN;
+	int ret = udev_enable_fd_handoff(udev, max_fds, idle_timeout_ms);
+	TRACE_END(udev_enable_fd_handoff, udev,
+	    (uint64_t)max_fds << 32 | idle_timeout_ms, (uint64_t)ret);
+	return ret;
+}
+
+char const *
+(udev_device_get_devnode)(struct udev_device *udev_device)
+{
+	TRACE_BEGIN;
+	char const *ret = udev_device_get_devnode(udev_device);
+	TRACE_END(udev_device_get_devnode, udev_device, 0, trace_string(ret));
+	return ret;
+}
+
+dev_t
+(udev_device_get_devnum)(struct udev_device *udev_device)
+{
+	TRACE_BEGIN;
+	dev_t ret = udev_device_get_devnum(udev_device);
+	TRACE_END(udev_device_get_devnum, udev_device, 0, (uint64_t)ret);
+	return ret;
+}
+
+char const *
+(udev_device_get_property_value)(
+    struct udev_device *dev, char const *property)
+{
+	TRACE_BEGIN;
+	char const *ret = udev_device_get_property_value(dev, property);
+	TRACE_END(udev_device_get_property_value, dev, 0, trace_string(ret),
+	    property);
+	return ret;
+}
+
+struct udev *
+(udev_device_get_udev)(struct udev_device *udev_device)
+{
+	TRACE_BEGIN;
+	struct udev *ret = udev_device_get_udev(udev_device);
+	TRACE_END(udev_device_get_udev, udev_device, 0, trace_object(ret));
+	return ret;
+}
+
+struct udev_device *
+(udev_device_new_from_syspath)(
+    struct udev *udev, char const *syspath)
+{
+	TRACE_BEGIN;
+	struct udev_device *ret = udev_device_new_from_syspath(udev, syspath);
+	TRACE_END(udev_device_new_from_syspath, udev, 0, trace_object(ret),
+	    syspath);
+	return ret;
+}
+
+struct udev_device *
+(udev_device_new_from_devnum)(
+    struct udev *udev, char type, dev_t devnum)
+{
+	TRACE_BEGIN;
+	struct udev_device *ret =
+	    udev_device_new_from_devnum(udev, type, devnum);
+	char const type_string[2] = {type, '\0'};
+	TRACE_END(udev_device_new_from_devnum, udev, (uint64_t)devnum,
+	    trace_object(ret), type_string);
+	return ret;
+}
+
+char const *
+(udev_device_get_syspath)(struct udev_device *udev_device)
+{
+	TRACE_BEGIN;
+	char const *ret = udev_device_get_syspath(udev_device);
+	TRACE_END(udev_device_get_syspath, udev_device, 0, trace_string(ret));
+	return ret;
+}
+
+char const *
+(udev_device_get_sysname)(struct udev_device *udev_device)
+{
+	TRACE_BEGIN;
+	char const *ret = udev_device_get_sysname(udev_device);
+	TRACE_END(udev_device_get_sysname, udev_device, 0, trace_string(ret));
+	return ret;
+}
+
+char const *
+(udev_device_get_subsystem)(struct udev_device *udev_device)
+{
+	TRACE_BEGIN;
+	char const *ret = udev_device_get_subsystem(udev_device);
+	TRACE_END(
+	    udev_device_get_subsystem, udev_device, 0, trace_string(ret));
+	return ret;
+}
+
+char const *
+(udev_device_get_devtype)(struct udev_device *udev_device)
+{
+	TRACE_BEGIN;
+	char const *ret = udev_device_get_devtype(udev_device);
+	TRACE_END(udev_device_get_devtype, udev_device, 0, trace_string(ret));
+	return ret;
+}
+
+char const *
+(udev_device_get_sysattr_value)(
+    struct udev_device *udev_device, char const *sysattr)
+{
+	TRACE_BEGIN;
+	char const *ret = udev_device_get_sysattr_value(udev_device, sysattr);
+	TRACE_END(udev_device_get_sysattr_value, udev_device, 0,
+	    trace_string(ret), sysattr);
+	return ret;
+}
+
+struct udev_list_entry *
+(udev_device_get_properties_list_entry)(
+    struct udev_device *udev_device)
+{
+	TRACE_BEGIN;
+	struct udev_list_entry *ret =
+	    udev_device_get_properties_list_entry(udev_device);
+	TRACE_END(udev_device_get_properties_list_entry, udev_device, 0,
+	    trace_object(ret));
+	return ret;
+}
+
+struct udev_device *
+(udev_device_ref)(struct udev_device *udev_device)
+{
+	TRACE_BEGIN;
+	struct udev_device *ret = udev_device_ref(udev_device);
+	TRACE_END(udev_device_ref, udev_device, 0, trace_object(ret));
+	return ret;
+}
+
+void
+(udev_device_unref)(struct udev_device *udev_device)
+{
+	TRACE_BEGIN;
+	udev_device_unref(udev_device);
+	TRACE_END(udev_device_unref, udev_device, 0, 0);
+}
+
+struct udev_device *
+(udev_device_get_parent)(struct udev_device *udev_device)
+{
+	TRACE_BEGIN;
+	struct udev_device *ret = udev_device_get_parent(udev_device);
+	TRACE_END(udev_device_get_parent, udev_device, 0, trace_object(ret));
+	return ret;
+}
+
+int
+(udev_device_get_is_initialized)(struct udev_device *udev_device)
+{
+	TRACE_BEGIN;
+	int ret = udev_device_get_is_initialized(udev_device);
+	TRACE_END(
+	    udev_device_get_is_initialized, udev_device, 0, (uint64_t)ret);
+	return ret;
+}
+
+char const *
+(udev_device_get_action)(struct udev_device *udev_device)
+{
+	TRACE_BEGIN;
+	char const *ret = udev_device_get_action(udev_device);
+	TRACE_END(udev_device_get_action, udev_device, 0, trace_string(ret));
+	return ret;
+}
+
+unsigned long long
+(udev_device_get_seqnum)(struct udev_device *udev_device)
+{
+	TRACE_BEGIN;
+	unsigned long long ret = udev_device_get_seqnum(udev_device);
+	TRACE_END(udev_device_get_seqnum, udev_device, 0, ret);
+	return ret;
+}
+
+int
+(udev_device_take_fd)(struct udev_device *udev_device)
+{
+	TRACE_BEGIN;
+	int ret = udev_device_take_fd(udev_device);
+	TRACE_END(udev_device_take_fd, udev_device, 0, (uint64_t)ret);
+	return ret;
+}
+
+unsigned long long
+(udev_device_get_usec_since_initialized)(
+    struct udev_device *udev_device)
+{
+	TRACE_BEGIN;
+	unsigned long long ret =
+	    udev_device_get_usec_since_initialized(udev_device);
+	TRACE_END(udev_device_get_usec_since_initialized, udev_device, 0, ret);
+	return ret;
+}
+
+struct udev_device *
+(udev_device_get_parent_with_subsystem_devtype)(
+    struct udev_device *udev_device, char const *subsystem,
+    char const *devtype)
+{
+	TRACE_BEGIN;
+	struct udev_device *ret =
+	    udev_device_get_parent_with_subsystem_devtype(
+		udev_device, subsystem, devtype);
+	TRACE_END(udev_device_get_parent_with_subsystem_devtype, udev_device,
+	    0, trace_object(ret), subsystem, devtype);
+	return ret;
+}
+
+struct udev_enumerate *
+(udev_enumerate_new)(struct udev *udev)
+{
+	TRACE_BEGIN;
+	struct udev_enumerate *ret = udev_enumerate_new(udev);
+	TRACE_END(udev_enumerate_new, udev, 0, trace_object(ret));
+	return ret;
+}
+
+int
+(udev_enumerate_add_match_subsystem)(
+    struct udev_enumerate *udev_enumerate, char const *subsystem)
+{
+	TRACE_BEGIN;
+	int ret =
+	    udev_enumerate_add_match_subsystem(udev_enumerate, subsystem);
+	TRACE_END(udev_enumerate_add_match_subsystem, udev_enumerate, 0,
+	    (uint64_t)ret, subsystem);
+	return ret;
+}
+
+int
+(udev_enumerate_scan_devices)(struct udev_enumerate *udev_enumerate)
+{
+	TRACE_BEGIN;
+	int ret = udev_enumerate_scan_devices(udev_enumerate);
+	TRACE_END(
+	    udev_enumerate_scan_devices, udev_enumerate, 0, (uint64_t)ret);
+	return ret;
+}
+
+struct udev_list_entry *
+(udev_enumerate_get_list_entry)(
+    struct udev_enumerate *udev_enumerate)
+{
+	TRACE_BEGIN;
+	struct udev_list_entry *ret =
+	    udev_enumerate_get_list_entry(udev_enumerate);
+	TRACE_END(udev_enumerate_get_list_entry, udev_enumerate, 0,
+	    trace_object(ret));
+	return ret;
+}
+
+int
+(udev_enumerate_add_match_sysname)(
+    struct udev_enumerate *udev_enumerate, char const *sysname)
+{
+	TRACE_BEGIN;
+	int ret = udev_enumerate_add_match_sysname(udev_enumerate, sysname);
+	TRACE_END(udev_enumerate_add_match_sysname, udev_enumerate, 0,
+	    (uint64_t)ret, sysname);
+	return ret;
+}
+
+int
+(udev_enumerate_add_match_property)(struct udev_enumerate *udev_enumerate,
+    char const *property, char const *value)
+{
+	TRACE_BEGIN;
+	int ret =
+	    udev_enumerate_add_match_property(udev_enumerate, property, value);
+	TRACE_END(udev_enumerate_add_match_property, udev_enumerate, 0,
+	    (uint64_t)ret, property, value);
+	return ret;
+}
+
+void
+(udev_enumerate_unref)(struct udev_enumerate *udev_enumerate)
+{
+	TRACE_BEGIN;
+	udev_enumerate_unref(udev_enumerate);
+	TRACE_END(udev_enumerate_unref, udev_enumerate, 0, 0);
+}
+
+size_t
+(udev_enumerate_get_count)(struct udev_enumerate *udev_enumerate)
+{
+	TRACE_BEGIN;
+	size_t ret = udev_enumerate_get_count(udev_enumerate);
+	TRACE_END(udev_enumerate_get_count, udev_enumerate, 0, ret);
+	return ret;
+}
+
+struct udev_list_entry *
+(udev_enumerate_get_entry)(
+    struct udev_enumerate *udev_enumerate, size_t index)
+{
+	TRACE_BEGIN;
+	struct udev_list_entry *ret =
+	    udev_enumerate_get_entry(udev_enumerate, index);
+	TRACE_END(udev_enumerate_get_entry, udev_enumerate, index,
+	    trace_object(ret));
+	return ret;
+}
+
+struct udev_list_entry *
+(udev_enumerate_find_sysname)(
+    struct udev_enumerate *udev_enumerate, char const *sysname)
+{
+	TRACE_BEGIN;
+	struct udev_list_entry *ret =
+	    udev_enumerate_find_sysname(udev_enumerate, sysname);
+	TRACE_END(udev_enumerate_find_sysname, udev_enumerate, 0,
+	    trace_object(ret), sysname);
+	return ret;
+}
+
+int
+(udev_enumerate_scan_devices_with_monitor)(
+    struct udev_enumerate *udev_enumerate, struct udev_monitor *udev_monitor)
+{
+	TRACE_BEGIN;
+	int ret = udev_enumerate_scan_devices_with_monitor(
+	    udev_enumerate, udev_monitor);
+	TRACE_END(udev_enumerate_scan_devices_with_monitor, udev_enumerate,
+	    trace_object(udev_monitor), (uint64_t)ret);
+	return ret;
+}
+
+char const *
+(udev_list_entry_get_name)(struct udev_list_entry *list_entry)
+{
+	TRACE_BEGIN;
+	char const *ret = udev_list_entry_get_name(list_entry);
+	TRACE_END(udev_list_entry_get_name, list_entry, 0, trace_string(ret));
+	return ret;
+}
+
+char const *
+(udev_list_entry_get_value)(struct udev_list_entry *list_entry)
+{
+	TRACE_BEGIN;
+	char const *ret = udev_list_entry_get_value(list_entry);
+	TRACE_END(
+	    udev_list_entry_get_value, list_entry, 0, trace_string(ret));
+	return ret;
+}
+
+struct udev_list_entry *
+(udev_list_entry_get_next)(
+    struct udev_list_entry *list_entry)
+{
+	TRACE_BEGIN;
+	struct udev_list_entry *ret = udev_list_entry_get_next(list_entry);
+	TRACE_END(udev_list_entry_get_next, list_entry, 0, trace_object(ret));
+	return ret;
+}
+
+struct udev_monitor *
+(udev_monitor_new_from_netlink)(
+    struct udev *udev, char const *name)
+{
+	TRACE_BEGIN;
+	struct udev_monitor *ret = udev_monitor_new_from_netlink(udev, name);
+	TRACE_END(udev_monitor_new_from_netlink, udev, 0, trace_object(ret),
+	    name);
+	return ret;
+}
+
+int
+(udev_monitor_filter_add_match_subsystem_devtype)(
+    struct udev_monitor *udev_monitor, char const *subsystem,
+    char const *devtype)
+{
+	TRACE_BEGIN;
+	int ret = udev_monitor_filter_add_match_subsystem_devtype(
+	    udev_monitor, subsystem, devtype);
+	TRACE_END(udev_monitor_filter_add_match_subsystem_devtype,
+	    udev_monitor, 0, (uint64_t)ret, subsystem, devtype);
+	return ret;
+}
+
+int
+(udev_monitor_enable_receiving)(struct udev_monitor *udev_monitor)
+{
+	TRACE_BEGIN;
+	int ret = udev_monitor_enable_receiving(udev_monitor);
+	TRACE_END(
+	    udev_monitor_enable_receiving, udev_monitor, 0, (uint64_t)ret);
+	return ret;
+}
+
+int
+(udev_monitor_get_fd)(struct udev_monitor *udev_monitor)
+{
+	TRACE_BEGIN;
+	int ret = udev_monitor_get_fd(udev_monitor);
+	TRACE_END(udev_monitor_get_fd, udev_monitor, 0, (uint64_t)ret);
+	return ret;
+}
+
+struct udev *
+(udev_monitor_get_udev)(struct udev_monitor *udev_monitor)
+{
+	TRACE_BEGIN;
+	struct udev *ret = udev_monitor_get_udev(udev_monitor);
+	TRACE_END(udev_monitor_get_udev, udev_monitor, 0, trace_object(ret));
+	return ret;
+}
+
+struct udev_device *
+(udev_monitor_receive_device)(
+    struct udev_monitor *udev_monitor)
+{
+	TRACE_BEGIN;
+	struct udev_device *ret = udev_monitor_receive_device(udev_monitor);
+	TRACE_END(
+	    udev_monitor_receive_device, udev_monitor, 0, trace_object(ret));
+	return ret;
+}
+
+void
+(udev_monitor_unref)(struct udev_monitor *udev_monitor)
+{
+	TRACE_BEGIN;
+	udev_monitor_unref(udev_monitor);
+	TRACE_END(udev_monitor_unref, udev_monitor, 0, 0);
+}
+
+ssize_t
+(udev_device_serialize)(
+    struct udev_device *udev_device, void *buf, size_t size)
+{
+	TRACE_BEGIN;
+	ssize_t ret = udev_device_serialize(udev_device, buf, size);
+	TRACE_END(udev_device_serialize, udev_device, size, (uint64_t)ret);
+	return ret;
+}
+
+struct udev_device *
+(udev_device_new_from_buffer)(
+    struct udev *udev, void const *buf, size_t size, size_t *used)
+{
+	TRACE_BEGIN;
+	struct udev_device *ret =
+	    udev_device_new_from_buffer(udev, buf, size, used);
+	TRACE_END(udev_device_new_from_buffer, udev, size, trace_object(ret));
+	return ret;
+}
+
+ssize_t
+(udev_enumerate_serialize)(
+    struct udev_enumerate *udev_enumerate, void *buf, size_t size)
+{
+	TRACE_BEGIN;
+	ssize_t ret = udev_enumerate_serialize(udev_enumerate, buf, size);
+	TRACE_END(
+	    udev_enumerate_serialize, udev_enumerate, size, (uint64_t)ret);
+	return ret;
+}
+
+int
+(udev_device_has_tag)(struct udev_device *udev_device, char const *tag)
+{
+	TRACE_BEGIN;
+	int ret = udev_device_has_tag(udev_device, tag);
+	TRACE_END(udev_device_has_tag, udev_device, 0, (uint64_t)ret, tag);
+	return ret;
+}
+
+int
+(udev_enumerate_add_match_tag)(
+    struct udev_enumerate *udev_enumerate, char const *tag)
+{
+	TRACE_BEGIN;
+	int ret = udev_enumerate_add_match_tag(udev_enumerate, tag);
+	TRACE_END(udev_enumerate_add_match_tag, udev_enumerate, 0,
+	    (uint64_t)ret, tag);
+	return ret;
+}
+
+int
+(udev_monitor_filter_add_match_tag)(
+    struct udev_monitor *udev_monitor, char const *tag)
+{
+	TRACE_BEGIN;
+	int ret = udev_monitor_filter_add_match_tag(udev_monitor, tag);
+	TRACE_END(udev_monitor_filter_add_match_tag, udev_monitor, 0,
+	    (uint64_t)ret, tag);
+	return ret;
+}
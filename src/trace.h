@@ -0,0 +1,213 @@
+#ifndef LIBUDEV_FBSD_TRACE_H_
+#define LIBUDEV_FBSD_TRACE_H_
+
+/*
+ * Call traces, written by the library and read by udev-replay.
+ *
+ * A library built with ENABLE_TRACE records every call a consumer makes
+ * into libudev.h to the file named by LIBUDEV_TRACE, if set.  The file is
+ * a trace_header followed by one trace_record per call, in the order the
+ * calls returned.  A record is followed by strings_size bytes holding the
+ * string arguments of the call, each NUL-terminated; a NULL argument is
+ * stored as an empty string and flagged in null_strings.
+ *
+ * Objects (contexts, devices, enumerates, monitors and list entries) are
+ * identified by their address in the recording process.  An address is
+ * only reused after the object was released, so the replay can map each
+ * one to its own object by the call that returned it.  Numeric results are
+ * stored as is, string results as 1 if they were non-NULL.
+ */
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "LUDVTRCE"
+#define TRACE_VERSION 1
+#define TRACE_ENV "LIBUDEV_TRACE"
+
+#define TRACE_CALLS(X)                                                        \
+	X(udev_new)                                                           \
+	X(udev_ref)                                                           \
+	X(udev_unref)                                                         \
+	X(udev_enable_live_enumeration)                                       \
+	X(udev_enable_fd_handoff)                                             \
+	X(udev_device_get_devnode)                                            \
+	X(udev_device_get_devnum)                                             \
+	X(udev_device_get_property_value)                                     \
+	X(udev_device_get_udev)                                               \
+	X(udev_device_new_from_syspath)                                       \
+	X(udev_device_new_from_devnum)                                        \
+	X(udev_device_get_syspath)                                            \
+	X(udev_device_get_sysname)                                            \
+	X(udev_device_get_subsystem)                                          \
+	X(udev_device_get_devtype)                                            \
+	X(udev_device_get_sysattr_value)                                      \
+	X(udev_device_get_properties_list_entry)                              \
+	X(udev_device_ref)                                                    \
+	X(udev_device_unref)                                                  \
+	X(udev_device_get_parent)                                             \
+	X(udev_device_get_is_initialized)                                     \
+	X(udev_device_get_action)                                             \
+	X(udev_device_get_seqnum)                                             \
+	X(udev_device_take_fd)                                                \
+	X(udev_device_get_usec_since_initialized)                             \
+	X(udev_device_get_parent_with_subsystem_devtype)                      \
+	X(udev_enumerate_new)                                                 \
+	X(udev_enumerate_add_match_subsystem)                                 \
+	X(udev_enumerate_scan_devices)                                        \
+	X(udev_enumerate_get_list_entry)                                      \
+	X(udev_enumerate_add_match_sysname)                                   \
+	X(udev_enumerate_add_match_property)                                  \
+	X(udev_enumerate_unref)                                               \
+	X(udev_enumerate_get_count)                                           \
+	X(udev_enumerate_get_entry)                                           \
+	X(udev_enumerate_find_sysname)                                        \
+	X(udev_enumerate_scan_devices_with_monitor)                           \
+	X(udev_list_entry_get_name)                                           \
+	X(udev_list_entry_get_value)                                          \
+	X(udev_list_entry_get_next)                                           \
+	X(udev_monitor_new_from_netlink)                                      \
+	X(udev_monitor_filter_add_match_subsystem_devtype)                    \
+	X(udev_monitor_enable_receiving)                                      \
+	X(udev_monitor_get_fd)                                                \
+	X(udev_monitor_get_udev)                                              \
+	X(udev_monitor_receive_device)                                        \
+	X(udev_monitor_unref)                                                 \
+	X(udev_device_serialize)                                              \
+	X(udev_device_new_from_buffer)                                        \
+	X(udev_enumerate_serialize)                                           \
+	X(udev_device_has_tag)                                                \
+	X(udev_enumerate_add_match_tag)                                       \
+	X(udev_monitor_filter_add_match_tag)
+
+enum trace_call {
+#define TRACE_ENUM(name) TRACE_##name,
+	TRACE_CALLS(TRACE_ENUM)
+#undef TRACE_ENUM
+	TRACE_CALL_COUNT
+};
+
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+struct trace_record {
+	uint8_t call;         /* enum trace_call */
+	uint8_t null_strings; /* bit n set: string argument n was NULL */
+	uint16_t strings_size;
+	uint32_t nsec;        /* duration of the call, saturated */
+	uint64_t object;      /* first argument */
+	uint64_t arg;         /* second object or numeric argument */
+	uint64_t result;
+};
+
+/*
+ * In a traced build, libudev.c defines the public functions under these
+ * names, hidden, and trace.c wraps them under the public ones.  The macros
+ * are function-like, so trace.c can still name a public function by
+ * parenthesizing it.
+ */
+#ifdef ENABLE_TRACE
+#define udev_new(...) udev_new_untraced(__VA_ARGS__)
+#define udev_ref(...) udev_ref_untraced(__VA_ARGS__)
+#define udev_unref(...) udev_unref_untraced(__VA_ARGS__)
+#define udev_enable_live_enumeration(...)                                     \
+	udev_enable_live_enumeration_untraced(__VA_ARGS__)
+#define udev_enable_fd_handoff(...)                                           \
+	udev_enable_fd_handoff_untraced(__VA_ARGS__)
+#define udev_device_get_devnode(...)                                          \
+	udev_device_get_devnode_untraced(__VA_ARGS__)
+#define udev_device_get_devnum(...)                                           \
+	udev_device_get_devnum_untraced(__VA_ARGS__)
+#define udev_device_get_property_value(...)                                   \
+	udev_device_get_property_value_untraced(__VA_ARGS__)
+#define udev_device_get_udev(...) udev_device_get_udev_untraced(__VA_ARGS__)
+#define udev_device_new_from_syspath(...)                                     \
+	udev_device_new_from_syspath_untraced(__VA_ARGS__)
+#define udev_device_new_from_devnum(...)                                      \
+	udev_device_new_from_devnum_untraced(__VA_ARGS__)
+#define udev_device_get_syspath(...)                                          \
+	udev_device_get_syspath_untraced(__VA_ARGS__)
+#define udev_device_get_sysname(...)                                          \
+	udev_device_get_sysname_untraced(__VA_ARGS__)
+#define udev_device_get_subsystem(...)                                        \
+	udev_device_get_subsystem_untraced(__VA_ARGS__)
+#define udev_device_get_devtype(...)                                          \
+	udev_device_get_devtype_untraced(__VA_ARGS__)
+#define udev_device_get_sysattr_value(...)                                    \
+	udev_device_get_sysattr_value_untraced(__VA_ARGS__)
+#define udev_device_get_properties_list_entry(...)                            \
+	udev_device_get_properties_list_entry_untraced(__VA_ARGS__)
+#define udev_device_ref(...) udev_device_ref_untraced(__VA_ARGS__)
+#define udev_device_unref(...) udev_device_unref_untraced(__VA_ARGS__)
+#define udev_device_get_parent(...)                                           \
+	udev_device_get_parent_untraced(__VA_ARGS__)
+#define udev_device_get_is_initialized(...)                                   \
+	udev_device_get_is_initialized_untraced(__VA_ARGS__)
+#define udev_device_get_action(...)                                           \
+	udev_device_get_action_untraced(__VA_ARGS__)
+#define udev_device_get_seqnum(...)                                           \
+	udev_device_get_seqnum_untraced(__VA_ARGS__)
+#define udev_device_take_fd(...) udev_device_take_fd_untraced(__VA_ARGS__)
+#define udev_device_get_usec_since_initialized(...)                           \
+	udev_device_get_usec_since_initialized_untraced(__VA_ARGS__)
+#define udev_device_get_parent_with_subsystem_devtype(...)                    \
+	udev_device_get_parent_with_subsystem_devtype_untraced(__VA_ARGS__)
+#define udev_enumerate_new(...) udev_enumerate_new_untraced(__VA_ARGS__)
+#define udev_enumerate_add_match_subsystem(...)                               \
+	udev_enumerate_add_match_subsystem_untraced(__VA_ARGS__)
+#define udev_enumerate_scan_devices(...)                                      \
+	udev_enumerate_scan_devices_untraced(__VA_ARGS__)
+#define udev_enumerate_get_list_entry(...)                                    \
+	udev_enumerate_get_list_entry_untraced(__VA_ARGS__)
+#define udev_enumerate_add_match_sysname(...)                                 \
+	udev_enumerate_add_match_sysname_untraced(__VA_ARGS__)
+#define udev_enumerate_add_match_property(...)                                \
+	udev_enumerate_add_match_property_untraced(__VA_ARGS__)
+#define udev_enumerate_unref(...) udev_enumerate_unref_untraced(__VA_ARGS__)
+#define udev_enumerate_get_count(...)                                         \
+	udev_enumerate_get_count_untraced(__VA_ARGS__)
+#define udev_enumerate_get_entry(...)                                         \
+	udev_enumerate_get_entry_untraced(__VA_ARGS__)
+#define udev_enumerate_find_sysname(...)                                      \
+	udev_enumerate_find_sysname_untraced(__VA_ARGS__)
+#define udev_enumerate_scan_devices_with_monitor(...)                         \
+	udev_enumerate_scan_devices_with_monitor_untraced(__VA_ARGS__)
+#define udev_list_entry_get_name(...)                                         \
+	udev_list_entry_get_name_untraced(__VA_ARGS__)
+#define udev_list_entry_get_value(...)                                        \
+	udev_list_entry_get_value_untraced(__VA_ARGS__)
+#define udev_list_entry_get_next(...)                                         \
+	udev_list_entry_get_next_untraced(__VA_ARGS__)
+#define udev_monitor_new_from_netlink(...)                                    \
+	udev_monitor_new_from_netlink_untraced(__VA_ARGS__)
+#define udev_monitor_filter_add_match_subsystem_devtype(...)                  \
+	udev_monitor_filter_add_match_subsystem_devtype_untraced(__VA_ARGS__)
+#define udev_monitor_enable_receiving(...)                                    \
+	udev_monitor_enable_receiving_untraced(__VA_ARGS__)
+#define udev_monitor_get_fd(...) udev_monitor_get_fd_untraced(__VA_ARGS__)
+#define udev_monitor_get_udev(...) udev_monitor_get_udev_untraced(__VA_ARGS__)
+#define udev_monitor_receive_device(...)                                      \
+	udev_monitor_receive_device_untraced(__VA_ARGS__)
+#define udev_monitor_unref(...) udev_monitor_unref_untraced(__VA_ARGS__)
+#define udev_device_serialize(...)                                            \
+	udev_device_serialize_untraced(__VA_ARGS__)
+#define udev_device_new_from_buffer(...)                                      \
+	udev_device_new_from_buffer_untraced(__VA_ARGS__)
+#define udev_enumerate_serialize(...)                                         \
+	udev_enumerate_serialize_untraced(__VA_ARGS__)
+#define udev_device_has_tag(...) udev_device_has_tag_untraced(__VA_ARGS__)
+#define udev_enumerate_add_match_tag(...)                                     \
+	udev_enumerate_add_match_tag_untraced(__VA_ARGS__)
+#define udev_monitor_filter_add_match_tag(...)                                \
+	udev_monitor_filter_add_match_tag_untraced(__VA_ARGS__)
+
+/* Declares them under the names above, keeping them out of the dynamic
+ * symbol table; only the wrappers are exported. */
+#pragma GCC visibility push(hidden)
+#include "libudev.h"
+#pragma GCC visibility pop
+#endif
+
+#endif
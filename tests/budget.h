@@ -0,0 +1,64 @@
+#ifndef LIBUDEV_FBSD_BUDGET_H_
+#define LIBUDEV_FBSD_BUDGET_H_
+
+/*
+ * Cost accounting for the budget tests.
+ *
+ * interpose.c replaces the allocator and the syscalls the library makes on
+ * device nodes, counts them per thread, and serves a synthetic /dev/input
+ * so that the tests run on any host.  Opening a synthetic node yields a
+ * descriptor that fake_libevdev.c, the libevdev stand-in, queries with the
+ * ioctls below.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <linux/input.h>
+
+struct budget {
+	unsigned allocs; /* malloc, calloc and realloc */
+	unsigned opens;
+	unsigned ioctls;
+	unsigned stats; /* stat, fstat and access */
+};
+
+/* Calls made by the calling thread so far. */
+struct budget budget_now(void);
+
+/* Makes budget_freed() report whether ptr was passed to free(). */
+void budget_watch_free(void const *ptr);
+bool budget_freed(void);
+
+struct fake_code {
+	uint16_t type;
+	uint16_t code;
+};
+
+/* What a synthetic node reports about itself. */
+struct fake_device {
+	struct input_id id;
+	char const *name;
+	char const *phys;
+	char const *uniq;
+	struct fake_code const *codes;
+	unsigned code_count;
+};
+
+/* Makes /dev/input/event<node> appear, as a new node each time. */
+void fake_node_add(unsigned node, struct fake_device const *dev);
+void fake_node_remove(unsigned node);
+
+#define FAKE_STR_SIZE 256
+#define FAKE_BITS_WORDS ((KEY_CNT + 63) / 64)
+
+/* Requests understood on synthetic nodes.  FAKE_EVIOC_BITS fills a bitmap
+ * of FAKE_BITS_WORDS words, the event types for type 0. */
+#define FAKE_EVIOC_ID 0x6c750000ul
+#define FAKE_EVIOC_NAME 0x6c750001ul
+#define FAKE_EVIOC_PHYS 0x6c750002ul
+#define FAKE_EVIOC_UNIQ 0x6c750003ul
+#define FAKE_EVIOC_PROPS 0x6c750004ul
+#define FAKE_EVIOC_BITS(type) (0x6c750100ul + (type))
+
+#endif
@@ -0,0 +1,309 @@
+/*
+ * Allocation and syscall budgets of the public entry points.
+ *
+ * Each check runs one call against a synthetic /dev/input (see budget.h)
+ * and fails if the calling thread allocated, opened, issued ioctls or
+ * looked up paths more often than the budget allows.  The budgets are the
+ * costs of the current implementation; one is raised only together with
+ * the change that needs it.  Work done by a monitor's listener thread is
+ * not charged to the consumer.
+ */
+#define _GNU_SOURCE
+
+#include "budget.h"
+
+#include "broker.h"
+#include "libudev.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <poll.h>
+#include <unistd.h>
+
+static unsigned failures;
+
+static void
+check(char const *what, struct budget before, struct budget limit)
+{
+	struct budget now = budget_now();
+	struct budget used = {
+	    now.allocs - before.allocs,
+	    now.opens - before.opens,
+	    now.ioctls - before.ioctls,
+	    now.stats - before.stats,
+	};
+	bool over = used.allocs > limit.allocs || used.opens > limit.opens ||
+	    used.ioctls > limit.ioctls || used.stats > limit.stats;
+
+	printf("%-42s %3u/%-3u %3u/%-3u %3u/%-3u %3u/%-3u%s\n", what,
+	    used.allocs, limit.allocs, used.opens, limit.opens, used.ioctls,
+	    limit.ioctls, used.stats, limit.stats, over ? "  OVER" : "");
+	failures += over;
+}
+
+/* Runs stmt and checks what it cost against the budget. */
+#define BUDGET(what, allocs, opens, ioctls, stats, stmt)                      \
+	do {                                                                  \
+		struct budget before_ = budget_now();                         \
+		stmt;                                                         \
+		check(what, before_,                                          \
+		    (struct budget){allocs, opens, ioctls, stats});           \
+	} while (0)
+
+static void
+expect(bool ok, char const *what)
+{
+	if (!ok) {
+		printf("FAILED: %s\n", what);
+		++failures;
+	}
+}
+
+static bool
+property_is(
+    struct udev_device *dev, char const *key, char const *expected)
+{
+	char const *value = udev_device_get_property_value(dev, key);
+	return value && strcmp(value, expected) == 0;
+}
+
+static struct fake_code keyboard_codes[KEY_D - KEY_ESC + 2];
+static struct fake_code const mouse_codes[] = {
+    {EV_SYN, SYN_REPORT},
+    {EV_KEY, BTN_LEFT},
+    {EV_KEY, BTN_RIGHT},
+    {EV_REL, REL_X},
+    {EV_REL, REL_Y},
+};
+
+static struct fake_device const keyboard = {
+    .id = {BUS_USB, 0x046d, 0xc31c, 0x0110},
+    .name = "Fake Keyboard",
+    .phys = "usb-0000:00:14.0-1/input0",
+    .codes = keyboard_codes,
+    .code_count = sizeof(keyboard_codes) / sizeof(keyboard_codes[0]),
+};
+/* A second interface of the same USB device. */
+static struct fake_device const keyboard_keys = {
+    .id = {BUS_USB, 0x046d, 0xc31c, 0x0110},
+    .name = "Fake Keyboard Consumer Control",
+    .phys = "usb-0000:00:14.0-1/input1",
+    .codes = keyboard_codes,
+    .code_count = sizeof(keyboard_codes) / sizeof(keyboard_codes[0]),
+};
+static struct fake_device const mouse = {
+    .id = {BUS_USB, 0x046d, 0xc077, 0x0111},
+    .name = "Fake Mouse",
+    .phys = "usb-0000:00:14.0-2/input0",
+    .codes = mouse_codes,
+    .code_count = sizeof(mouse_codes) / sizeof(mouse_codes[0]),
+};
+
+static void
+test_devices(struct udev *udev)
+{
+	struct udev_enumerate *e = udev_enumerate_new(udev);
+	udev_enumerate_add_match_subsystem(e, "input");
+
+	int ret;
+	BUDGET("udev_enumerate_scan_devices", 1, 0, 0, 100,
+	    ret = udev_enumerate_scan_devices(e));
+	expect(ret == 0 && udev_enumerate_get_count(e) == 3,
+	    "scan finds the three nodes");
+	udev_enumerate_unref(e);
+
+	struct udev_device *dev;
+	BUDGET("udev_device_new_from_syspath", 1, 0, 0, 1,
+	    dev = udev_device_new_from_syspath(udev, "/dev/input/event0"));
+	expect(dev != NULL, "device is created");
+
+	/* One open of the node and one libevdev probe; the rest is looking
+	 * for the hwdb and recording the result in the snapshot under its
+	 * lock. */
+	bool is_keyboard;
+	BUDGET("udev_device_get_property_value, probing", 4, 5, 7, 2,
+	    is_keyboard = property_is(dev, "ID_INPUT_KEYBOARD", "1"));
+	expect(is_keyboard, "keyboard is classified");
+	BUDGET("udev_device_get_property_value, probed", 0, 0, 0, 0,
+	    is_keyboard = property_is(dev, "ID_INPUT_KEYBOARD", "1"));
+
+	struct udev_device *parent;
+	BUDGET("udev_device_get_parent", 10, 0, 0, 0,
+	    parent = udev_device_get_parent(dev));
+	expect(parent && property_is(parent, "NAME", "Fake Keyboard"),
+	    "parent carries the name");
+	BUDGET("udev_device_get_parent, known", 0, 0, 0, 0,
+	    parent = udev_device_get_parent(dev));
+
+	/* The USB device is shared with the first interface. */
+	struct udev_device *sibling =
+	    udev_device_new_from_syspath(udev, "/dev/input/event2");
+	udev_device_get_is_initialized(sibling);
+	struct udev_device *sibling_parent;
+	BUDGET("udev_device_get_parent, shared USB parent", 5, 0, 0, 0,
+	    sibling_parent = udev_device_get_parent(sibling));
+	expect(sibling_parent &&
+		udev_device_get_parent(sibling_parent) ==
+		    udev_device_get_parent(parent),
+	    "interfaces share the USB parent");
+	udev_device_unref(sibling);
+
+	/* Recorded in the snapshot: no open, no ioctl. */
+	udev_device_unref(dev);
+	BUDGET("udev_device_new_from_syspath, recorded", 1, 0, 0, 1,
+	    dev = udev_device_new_from_syspath(udev, "/dev/input/event0"));
+	BUDGET("udev_device_get_property_value, recorded", 1, 0, 0, 1,
+	    is_keyboard = property_is(dev, "ID_INPUT_KEYBOARD", "1"));
+	expect(is_keyboard, "recorded keyboard is classified");
+	udev_device_unref(dev);
+}
+
+static struct udev_device *
+receive(struct udev_monitor *mon)
+{
+	struct pollfd pfd = {udev_monitor_get_fd(mon), POLLIN, 0};
+	if (poll(&pfd, 1, 5000) != 1) {
+		return NULL;
+	}
+
+	struct udev_device *dev;
+	BUDGET("udev_monitor_receive_device", 0, 0, 0, 0,
+	    dev = udev_monitor_receive_device(mon));
+	return dev;
+}
+
+static void
+send_event(int fd, char const *type, unsigned node)
+{
+	char event[128];
+	int len = snprintf(event, sizeof(event),
+	    "!system=DEVFS subsystem=CDEV type=%s cdev=input/event%u\n",
+	    type, node);
+	expect(send(fd, event, (size_t)len, 0) == len, "devd event is sent");
+}
+
+static void
+test_monitor(struct udev *udev, char const *dir)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = PF_LOCAL;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/devd.pipe", dir);
+	setenv(DEVD_SOCKET_ENV, addr.sun_path, 1);
+
+	int listen_fd = socket(PF_LOCAL, SOCK_SEQPACKET, 0);
+	if (listen_fd < 0 ||
+	    bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(listen_fd, 1) < 0) {
+		expect(false, "devd stand-in listens");
+		return;
+	}
+
+	struct udev_monitor *mon = udev_monitor_new_from_netlink(udev, "udev");
+	udev_monitor_filter_add_match_subsystem_devtype(mon, "input", NULL);
+	udev_monitor_enable_receiving(mon);
+	int devd = accept(listen_fd, NULL, NULL);
+	expect(devd >= 0, "monitor connects");
+
+	fake_node_add(5, &mouse);
+	send_event(devd, "CREATE", 5);
+	struct udev_device *dev = receive(mon);
+	expect(dev && strcmp(udev_device_get_action(dev), "add") == 0,
+	    "add is received");
+
+	/* The listener probed the device before delivering it. */
+	bool is_mouse = false;
+	if (dev) {
+		BUDGET("udev_device_get_property_value, received", 0, 0, 0,
+		    0, is_mouse = property_is(dev, "ID_INPUT_MOUSE", "1"));
+		udev_device_unref(dev);
+	}
+	expect(is_mouse, "received mouse is classified");
+
+	fake_node_remove(5);
+	send_event(devd, "DESTROY", 5);
+	dev = receive(mon);
+	expect(dev && strcmp(udev_device_get_action(dev), "remove") == 0,
+	    "remove is received");
+	if (dev) {
+		udev_device_unref(dev);
+	}
+
+	udev_monitor_unref(mon);
+	close(devd);
+	close(listen_fd);
+	unlink(addr.sun_path);
+}
+
+/* A context must stay alive as long as devices and parents made from it,
+ * whatever order the references are dropped in. */
+static void
+test_context_lifetime(void)
+{
+	struct udev *udev = udev_new();
+	struct udev_device *dev =
+	    udev_device_new_from_syspath(udev, "/dev/input/event0");
+	struct udev_device *parent = udev_device_get_parent(dev);
+	expect(parent != NULL, "parent is interned");
+
+	budget_watch_free(udev);
+	udev_unref(udev);
+	if (budget_freed()) {
+		/* Anything touching dev now would use the freed context. */
+		expect(false, "devices keep their context");
+		return;
+	}
+	expect(udev_device_get_udev(dev) == udev &&
+		property_is(parent, "NAME", "Fake Keyboard"),
+	    "devices are usable after udev_unref()");
+
+	udev_device_unref(dev);
+	expect(budget_freed(), "the last device releases the context");
+	budget_watch_free(NULL);
+}
+
+int
+main(void)
+{
+	char dir[] = "/tmp/budget-test.XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	keyboard_codes[0] = (struct fake_code){EV_SYN, SYN_REPORT};
+	for (unsigned k = KEY_ESC; k <= KEY_D; ++k) {
+		keyboard_codes[k - KEY_ESC + 1] =
+		    (struct fake_code){EV_KEY, (uint16_t)k};
+	}
+	fake_node_add(0, &keyboard);
+	fake_node_add(1, &mouse);
+	fake_node_add(2, &keyboard_keys);
+	unlink(SNAPSHOT_PATH);
+	unlink(SNAPSHOT_PATH ".lock");
+
+	printf("%-42s %7s %7s %7s %7s\n", "call", "allocs", "opens",
+	    "ioctls", "stats");
+
+	struct udev *udev = udev_new();
+	test_devices(udev);
+	test_monitor(udev, dir);
+	udev_unref(udev);
+
+	test_context_lifetime();
+
+	unlink(SNAPSHOT_PATH);
+	unlink(SNAPSHOT_PATH ".lock");
+	rmdir(dir);
+
+	if (failures) {
+		printf("%u checks failed\n", failures);
+		return 1;
+	}
+	return 0;
+}
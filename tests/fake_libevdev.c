@@ -0,0 +1,132 @@
+/*
+ * libevdev stand-in for the budget tests.  Like libevdev, it reads
+ * everything about a device when it is created, one ioctl per name and per
+ * bitmap, so the tests count what a probe costs on a real node.
+ */
+#include "budget.h"
+
+#include <libevdev/libevdev.h>
+
+#include <sys/ioctl.h>
+
+#include <errno.h>
+#include <stdlib.h>
+
+struct libevdev {
+	int fd;
+	struct input_id id;
+	char name[FAKE_STR_SIZE];
+	char phys[FAKE_STR_SIZE];
+	char uniq[FAKE_STR_SIZE];
+	uint64_t props[FAKE_BITS_WORDS];
+	/* Indexed by event type; bits[0] holds the types themselves. */
+	uint64_t bits[EV_CNT][FAKE_BITS_WORDS];
+};
+
+static bool
+bit_test(uint64_t const *bits, unsigned bit)
+{
+	return bit < FAKE_BITS_WORDS * 64 &&
+	    ((bits[bit / 64] >> (bit % 64)) & 1);
+}
+
+int
+libevdev_new_from_fd(int fd, struct libevdev **dev)
+{
+	struct libevdev *d = calloc(1, sizeof(*d));
+	if (!d) {
+		return -ENOMEM;
+	}
+	d->fd = fd;
+
+	if (ioctl(fd, FAKE_EVIOC_ID, &d->id) < 0 ||
+	    ioctl(fd, FAKE_EVIOC_NAME, d->name) < 0 ||
+	    ioctl(fd, FAKE_EVIOC_PHYS, d->phys) < 0 ||
+	    ioctl(fd, FAKE_EVIOC_UNIQ, d->uniq) < 0 ||
+	    ioctl(fd, FAKE_EVIOC_PROPS, d->props) < 0 ||
+	    ioctl(fd, FAKE_EVIOC_BITS(0), d->bits[0]) < 0) {
+		goto fail;
+	}
+	for (unsigned type = 1; type < EV_CNT; ++type) {
+		if (bit_test(d->bits[0], type) &&
+		    ioctl(fd, FAKE_EVIOC_BITS(type), d->bits[type]) < 0) {
+			goto fail;
+		}
+	}
+
+	*dev = d;
+	return 0;
+
+fail:;
+	int err = errno;
+	free(d);
+	return -err;
+}
+
+void
+libevdev_free(struct libevdev *dev)
+{
+	free(dev);
+}
+
+int
+libevdev_has_event_type(struct libevdev const *dev, unsigned int type)
+{
+	return type < EV_CNT && bit_test(dev->bits[0], type);
+}
+
+int
+libevdev_has_event_code(
+    struct libevdev const *dev, unsigned int type, unsigned int code)
+{
+	return type < EV_CNT && bit_test(dev->bits[0], type) &&
+	    bit_test(dev->bits[type], code);
+}
+
+int
+libevdev_has_property(struct libevdev const *dev, unsigned int prop)
+{
+	return bit_test(dev->props, prop);
+}
+
+char const *
+libevdev_get_name(struct libevdev const *dev)
+{
+	return dev->name;
+}
+
+char const *
+libevdev_get_phys(struct libevdev const *dev)
+{
+	return dev->phys[0] ? dev->phys : NULL;
+}
+
+char const *
+libevdev_get_uniq(struct libevdev const *dev)
+{
+	return dev->uniq[0] ? dev->uniq : NULL;
+}
+
+int
+libevdev_get_id_bustype(struct libevdev const *dev)
+{
+	return dev->id.bustype;
+}
+
+int
+libevdev_get_id_vendor(struct libevdev const *dev)
+{
+	return dev->id.vendor;
+}
+
+int
+libevdev_get_id_product(struct libevdev const *dev)
+{
+	return dev->id.product;
+}
+
+int
+libevdev_get_id_version(struct libevdev const *dev)
+{
+	return dev->id.version;
+}
@@ -0,0 +1,391 @@
+/*
+ * Counting replacements for the allocator and the node syscalls, see
+ * budget.h.  Everything not aimed at /dev/input/event* is passed to the
+ * next definition, found with dlsym(RTLD_NEXT).
+ */
+#define _GNU_SOURCE
+
+#include "budget.h"
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#define FAKE_NODES 100
+#define FAKE_MAJOR 13
+#define FAKE_FDS 1024
+
+static _Thread_local struct budget counts;
+
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+static int (*real_open)(char const *, int, ...);
+static int (*real_close)(int);
+static int (*real_ioctl)(int, unsigned long, ...);
+static int (*real_stat)(char const *, struct stat *);
+static int (*real_fstat)(int, struct stat *);
+static int (*real_access)(char const *, int);
+
+/* dlsym() may allocate before the real allocator is known; those blocks
+ * come from here and are never freed. */
+static _Alignas(16) char boot_heap[64 * 1024];
+static size_t boot_used;
+static bool resolving;
+
+static void const *watched;
+static atomic_bool watched_freed;
+
+static pthread_mutex_t fake_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+	struct fake_device const *dev;
+	unsigned generation;
+} fake_nodes[FAKE_NODES];
+static unsigned fake_generation;
+/* Synthetic node behind each descriptor, plus one; 0 for real ones. */
+static atomic_uint fake_fds[FAKE_FDS];
+
+static void
+resolve(void)
+{
+	resolving = true;
+	real_malloc = dlsym(RTLD_NEXT, "malloc");
+	real_calloc = dlsym(RTLD_NEXT, "calloc");
+	real_realloc = dlsym(RTLD_NEXT, "realloc");
+	real_open = dlsym(RTLD_NEXT, "open");
+	real_close = dlsym(RTLD_NEXT, "close");
+	real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+	real_stat = dlsym(RTLD_NEXT, "stat");
+	real_fstat = dlsym(RTLD_NEXT, "fstat");
+	real_access = dlsym(RTLD_NEXT, "access");
+	real_free = dlsym(RTLD_NEXT, "free");
+	resolving = false;
+
+	if (!real_malloc || !real_calloc || !real_realloc || !real_free ||
+	    !real_open || !real_close || !real_ioctl || !real_stat ||
+	    !real_fstat || !real_access) {
+		abort();
+	}
+}
+
+/* Resolves the real functions on first use.  Returns false while doing
+ * so, when allocations have to be served from the boot heap. */
+static bool
+ready(void)
+{
+	if (!real_free && !resolving) {
+		resolve();
+	}
+	return real_free != NULL;
+}
+
+static void *
+boot_alloc(size_t size)
+{
+	size_t need = (size + 15) & ~(size_t)15;
+	if (need > sizeof(boot_heap) - boot_used) {
+		abort();
+	}
+	void *ptr = boot_heap + boot_used;
+	boot_used += need;
+	return ptr;
+}
+
+static bool
+is_boot(void const *ptr)
+{
+	return (char const *)ptr >= boot_heap &&
+	    (char const *)ptr < boot_heap + sizeof(boot_heap);
+}
+
+void *
+malloc(size_t size)
+{
+	if (!ready()) {
+		return boot_alloc(size);
+	}
+	++counts.allocs;
+	return real_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	if (!ready()) {
+		/* The boot heap is zeroed and never reused. */
+		return boot_alloc(n * size);
+	}
+	++counts.allocs;
+	return real_calloc(n, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	if (!ready() || is_boot(ptr)) {
+		abort();
+	}
+	++counts.allocs;
+	return real_realloc(ptr, size);
+}
+
+void
+free(void *ptr)
+{
+	if (!ptr || is_boot(ptr)) {
+		return;
+	}
+	if (ptr == watched) {
+		atomic_store(&watched_freed, true);
+	}
+	real_free(ptr);
+}
+
+struct budget
+budget_now(void)
+{
+	return counts;
+}
+
+void
+budget_watch_free(void const *ptr)
+{
+	watched = ptr;
+	atomic_store(&watched_freed, false);
+}
+
+bool
+budget_freed(void)
+{
+	return atomic_load(&watched_freed);
+}
+
+void
+fake_node_add(unsigned node, struct fake_device const *dev)
+{
+	pthread_mutex_lock(&fake_lock);
+	fake_nodes[node].dev = dev;
+	fake_nodes[node].generation = ++fake_generation;
+	pthread_mutex_unlock(&fake_lock);
+}
+
+void
+fake_node_remove(unsigned node)
+{
+	pthread_mutex_lock(&fake_lock);
+	fake_nodes[node].dev = NULL;
+	pthread_mutex_unlock(&fake_lock);
+}
+
+/* Returns the node a path names, or FAKE_NODES if it is no event node. */
+static unsigned
+fake_node_of(char const *path)
+{
+	unsigned node;
+	int len = 0;
+
+	if (sscanf(path, "/dev/input/event%u%n", &node, &len) != 1 ||
+	    path[len] != '\0' || node >= FAKE_NODES) {
+		return FAKE_NODES;
+	}
+	return node;
+}
+
+static bool
+fake_node_stat(unsigned node, struct stat *st)
+{
+	pthread_mutex_lock(&fake_lock);
+	bool present = fake_nodes[node].dev != NULL;
+	unsigned generation = fake_nodes[node].generation;
+	pthread_mutex_unlock(&fake_lock);
+
+	if (!present) {
+		errno = ENOENT;
+		return false;
+	}
+	if (st) {
+		memset(st, 0, sizeof(*st));
+		st->st_mode = S_IFCHR | 0644;
+		st->st_nlink = 1;
+		st->st_rdev = makedev(FAKE_MAJOR, node);
+		st->st_ino = (ino_t)generation * FAKE_NODES + node + 1;
+		st->st_ctim.tv_sec = (time_t)generation;
+	}
+	return true;
+}
+
+static void
+copy_string(void *arg, char const *s)
+{
+	snprintf(arg, FAKE_STR_SIZE, "%s", s ? s : "");
+}
+
+static int
+fake_ioctl(unsigned node, unsigned long request, void *arg)
+{
+	pthread_mutex_lock(&fake_lock);
+	struct fake_device const *dev = fake_nodes[node].dev;
+	pthread_mutex_unlock(&fake_lock);
+
+	/* Like the kernel, a removed node fails every request. */
+	if (!dev) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	uint64_t *bits = arg;
+	switch (request) {
+	case FAKE_EVIOC_ID:
+		memcpy(arg, &dev->id, sizeof(dev->id));
+		return 0;
+	case FAKE_EVIOC_NAME:
+		copy_string(arg, dev->name);
+		return 0;
+	case FAKE_EVIOC_PHYS:
+		copy_string(arg, dev->phys);
+		return 0;
+	case FAKE_EVIOC_UNIQ:
+		copy_string(arg, dev->uniq);
+		return 0;
+	case FAKE_EVIOC_PROPS:
+		memset(bits, 0, FAKE_BITS_WORDS * sizeof(*bits));
+		return 0;
+	}
+
+	if (request < FAKE_EVIOC_BITS(0) ||
+	    request >= FAKE_EVIOC_BITS(EV_CNT)) {
+		errno = ENOTTY;
+		return -1;
+	}
+
+	unsigned type = (unsigned)(request - FAKE_EVIOC_BITS(0));
+	memset(bits, 0, FAKE_BITS_WORDS * sizeof(*bits));
+	for (unsigned i = 0; i < dev->code_count; ++i) {
+		unsigned code = type == 0 ? dev->codes[i].type
+					  : dev->codes[i].code;
+		if ((type == 0 || dev->codes[i].type == type) &&
+		    code < FAKE_BITS_WORDS * 64) {
+			bits[code / 64] |= UINT64_C(1) << (code % 64);
+		}
+	}
+	return 0;
+}
+
+int
+open(char const *path, int flags, ...)
+{
+	mode_t mode = 0;
+	if (flags & O_CREAT) {
+		va_list ap;
+		va_start(ap, flags);
+		mode = (mode_t)va_arg(ap, int);
+		va_end(ap);
+	}
+
+	ready();
+	++counts.opens;
+
+	unsigned node = fake_node_of(path);
+	if (node == FAKE_NODES) {
+		return real_open(path, flags, mode);
+	}
+	if (!fake_node_stat(node, NULL)) {
+		return -1;
+	}
+
+	int fd = real_open("/dev/null", O_RDONLY | (flags & O_CLOEXEC));
+	if (fd >= FAKE_FDS) {
+		real_close(fd);
+		errno = EMFILE;
+		return -1;
+	}
+	if (fd >= 0) {
+		atomic_store(&fake_fds[fd], node + 1);
+	}
+	return fd;
+}
+
+int
+close(int fd)
+{
+	ready();
+	if (fd >= 0 && fd < FAKE_FDS) {
+		atomic_store(&fake_fds[fd], 0);
+	}
+	return real_close(fd);
+}
+
+int
+ioctl(int fd, unsigned long request, ...)
+{
+	va_list ap;
+	va_start(ap, request);
+	void *arg = va_arg(ap, void *);
+	va_end(ap);
+
+	ready();
+	++counts.ioctls;
+
+	unsigned node = fd >= 0 && fd < FAKE_FDS ? atomic_load(&fake_fds[fd])
+						 : 0;
+	if (node == 0) {
+		return real_ioctl(fd, request, arg);
+	}
+	return fake_ioctl(node - 1, request, arg);
+}
+
+int
+stat(char const *path, struct stat *st)
+{
+	ready();
+	++counts.stats;
+
+	unsigned node = fake_node_of(path);
+	if (node == FAKE_NODES) {
+		return real_stat(path, st);
+	}
+	return fake_node_stat(node, st) ? 0 : -1;
+}
+
+int
+fstat(int fd, struct stat *st)
+{
+	ready();
+	++counts.stats;
+
+	unsigned node = fd >= 0 && fd < FAKE_FDS ? atomic_load(&fake_fds[fd])
+						 : 0;
+	if (node == 0) {
+		return real_fstat(fd, st);
+	}
+	return fake_node_stat(node - 1, st) ? 0 : -1;
+}
+
+int
+access(char const *path, int amode)
+{
+	ready();
+	++counts.stats;
+
+	unsigned node = fake_node_of(path);
+	if (node == FAKE_NODES) {
+		return real_access(path, amode);
+	}
+	return fake_node_stat(node, NULL) ? 0 : -1;
+}